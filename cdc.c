@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cdc.h"
+#include "hash.h"
+#include "keycache.h"
+
+/* Files whose index is kept */
+#define CDC_CACHE 64
+
+static uint64_t gear[256];
+static int gear_ready = 0;
+
+static cdc_index cache[CDC_CACHE];
+static keycache_slot slots[CDC_CACHE];
+static keycache indexed = KEYCACHE_INIT(slots);
+
+/* Fixed pseudo random table, the same in every build (splitmix64) */
+static void init_gear()
+{
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = 1;
+}
+
+/* Length of the chunk starting at buf, n bytes available */
+static int cut(const char *buf, int n)
+{
+    const uint64_t mask = ((1ULL << CDC_AVG_BITS) - 1) << (64 - CDC_AVG_BITS);
+    uint64_t h = 0;
+    int i;
+
+    if (n <= CDC_MIN_CHUNK) return n;
+    if (n > CDC_MAX_CHUNK) n = CDC_MAX_CHUNK;
+
+    for (i = 0; i < CDC_MIN_CHUNK; i++) h = (h << 1) + gear[(unsigned char)buf[i]];
+    for (; i < n; i++) {
+        h = (h << 1) + gear[(unsigned char)buf[i]];
+        if (!(h & mask)) return i + 1;
+    }
+
+    return n;
+}
+
+static int build(cdc_index *idx, FILE *f)
+{
+    char *buf = malloc(2 * CDC_MAX_CHUNK);
+    int have = 0, cap = 16, n, len;
+    long long offset = 0;
+
+    idx->count = 0;
+    idx->chunks = malloc(cap * sizeof(cdc_chunk));
+    if (buf == NULL || idx->chunks == NULL) {
+        free(buf);
+        return -1;
+    }
+
+    do {
+        /* Keep at least one maximal chunk in the window */
+        n = fread(buf + have, sizeof(char), 2 * CDC_MAX_CHUNK - have, f);
+        have += n;
+
+        while (have >= CDC_MAX_CHUNK || (n == 0 && have > 0)) {
+            len = cut(buf, have);
+
+            if (idx->count == cap) {
+                /* The old block stays the caller's to free if this fails */
+                cdc_chunk *more = realloc(idx->chunks, 2 * cap * sizeof(cdc_chunk));
+                if (more == NULL) {
+                    free(buf);
+                    return -1;
+                }
+                idx->chunks = more;
+                cap *= 2;
+            }
+            idx->chunks[idx->count].offset = offset;
+            idx->chunks[idx->count].length = len;
+            idx->chunks[idx->count].hash = xxh64(buf, len, 0);
+            idx->count++;
+
+            offset += len;
+            have -= len;
+            memmove(buf, buf + len, have);
+        }
+    } while (n > 0);
+
+    free(buf);
+
+    return ferror(f) ? -1 : 1;
+}
+
+const cdc_index *cdc_lookup(const char *path)
+{
+    struct stat st;
+    cdc_index *idx;
+    int hit;
+
+    if (!gear_ready) init_gear();
+    if (stat(path, &st) < 0) return NULL;
+
+    idx = &cache[keycache_find(&indexed, &st, &hit)];
+    if (hit) return idx;
+
+    /* Not indexed yet, or changed since: (re)build */
+    free(idx->chunks);
+    idx->chunks = NULL;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return NULL;
+    if (build(idx, f) < 0) {
+        free(idx->chunks);
+        idx->chunks = NULL;
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+
+    idx->size = st.st_size;
+    keycache_store(&indexed, idx - cache, &st);
+
+    return idx;
+}
@@ -0,0 +1,31 @@
+#ifndef CDC
+#define CDC
+
+#include <stdint.h>
+
+/* Content defined chunking: a file is cut where a rolling (gear) hash of
+   the last bytes hits a pattern, so identical regions give identical
+   chunks wherever they sit in the file. Each chunk is named by the
+   XXH64 of its bytes. */
+
+#define CDC_MIN_CHUNK (2 * 1024)
+#define CDC_AVG_BITS 13
+#define CDC_MAX_CHUNK (64 * 1024)
+
+typedef struct {
+    long long offset;
+    int length;
+    uint64_t hash;
+} cdc_chunk;
+
+typedef struct {
+    long long size;
+    int count;
+    cdc_chunk *chunks;
+} cdc_index;
+
+/* The chunk index of a file, built on first use and kept while the file
+   does not change. NULL if the file cannot be read. */
+const cdc_index *cdc_lookup(const char *path);
+
+#endif
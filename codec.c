@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "codec.h"
+#include "pace.h"
+#include "tune.h"
+
+/* Bit manipulation */
+#define get_bit(x, pos) (((x >> pos) & 1) == 1 ? 1 : 0)
+
+/* Tricks to help at hamming mode */
+/* Indexes for data bits */
+static const int data_bits[8] = {1, 7, 6, 5, 3, 2, 1, 0};
+static const int first_data_in_byte_2 = 1;
+/* Indexes needed to calculate the 0th control bit */
+static const int c0_bit[6] = {3, 1, 7, 5, 3, 1};
+static const int first_c0_in_byte_2 = 2;
+/* Indexes needed to calculate the 1st control bit */
+static const int c1_bit[6] = {2, 1, 6, 5, 2, 1};
+static const int first_c1_in_byte_2 = 2;
+/* Indexes needed to calculate the 2nd control bit */
+static const int c2_bit[5] = {0, 7, 6, 5, 0};
+static const int first_c2_in_byte_2 = 1;
+/* Indexes needed to calculate the 3rd control bit */
+static const int c3_bit[5] = {4, 3, 2, 1, 0};
+static const int first_c3_in_byte_2 = 0;
+
+static inline int get_ones(char x)
+{
+    int no_of_ones = 0;
+    while (x) {
+        x = x & (x - 1);
+        no_of_ones++;
+    }
+
+    return (no_of_ones & 1);
+}
+
+static inline void set_parity(char* seq, int index, int parity)
+{
+    int i;
+    for (i = 0; i < 8; i++) seq[index] &= ~(1 << i);
+    if (parity) seq[index] |= 1;
+
+}
+
+static inline int get_parity(char *seq, int starting_from, int seq_len)
+{
+    int i;
+    int nb_ones = 0;
+    for (i = starting_from; i < seq_len; i++) {
+        nb_ones += get_ones(seq[i]);
+    }
+
+    /* Check the parity */
+    return (nb_ones & 1);
+}
+
+static inline int is_parity_correct(msg *r)
+{
+    /* First check the parity of bytes starting at pos 1 in the char seq */
+    int calculated_parity = get_parity(r->payload, 1, r->len);
+    int received_parity = get_bit(r->payload[0], 0);
+
+    /* Check the results */
+    if (calculated_parity == received_parity) return 1;
+    return 0;
+}
+
+static int wait_until_ack(msg* r, msg* t)
+{
+    int res;
+
+    if (r->len == 5) {
+        do {
+            /* The client saw our package damaged */
+            tune_errors(8 * t->len, 1);
+
+            /* Send again the package */
+            res = send_message(t);
+            if (res < 0) {
+                perror("[SERVER] Error while sending again\n");
+                return -1;
+            }
+
+            /* Wait for the confirmation */
+            res = recv_message(r);
+            if (res < 0) {
+                perror("[SERVER] Error, confirmation not received\n");
+                return -1;
+            }
+
+        } while (r->len == 5);
+    }
+    tune_errors(8 * t->len, 0);
+
+    return 1;
+}
+
+static int wait_until_correct_parity(msg* r, msg* t)
+{
+    int res;
+
+    do {
+        tune_errors(8 * r->len, 1);
+
+        /* Send NACK */
+        sprintf(t->payload, NACK);
+        t->len = strlen(t->payload) + 1;
+        res = send_message(t);
+        if (res < 0) {
+            perror("[SERVER] Send NACK error. Exiting.\n");
+            return -1;
+        }
+
+        /* Receive again the package */
+        res = recv_message(r);
+        if (res < 0) {
+            perror("[SERVER] Receive error. Exiting\n");
+            return -1;
+        }
+
+    } while (!is_parity_correct(r));
+
+    return 1;
+}
+
+static int detect_correct_errors_and_decode(msg* r)
+{
+    int i, error, corrected = 0;
+    char decoded_message[r->len / 2];
+
+    /* Detect error in case we have one */
+    /* Take each and every chunk of 2 bytes and apply hamming algorithm on it */
+    int chunk;
+    int control_bit0, control_bit1, control_bit2, control_bit3;
+    for (chunk = 0; chunk < r->len; chunk += 2) {
+
+        /* Detect error on the current chunk of 2 bytes -> r->payload[chunk] and r->payload[chunk + 1] */
+        control_bit0 = control_bit1 = control_bit2 = control_bit3 = 0;
+
+        /* Compute control_bit0 */
+        for (i = 0; i < first_c0_in_byte_2; i++) {
+            control_bit0 += get_bit(r->payload[chunk], c0_bit[i]);
+        }
+        for (i = first_c0_in_byte_2; i < 6; i++) {
+            control_bit0 += get_bit(r->payload[chunk + 1], c0_bit[i]);
+        }
+
+        /* Compute control_bit1 */
+        for (i = 0; i < first_c1_in_byte_2; i++) {
+            control_bit1 += get_bit(r->payload[chunk], c1_bit[i]);
+        }
+        for (i = first_c1_in_byte_2; i < 6; i++) {
+            control_bit1 += get_bit(r->payload[chunk + 1], c1_bit[i]);
+        }
+
+        /* Compute control_bit2 */
+        for (i = 0; i < first_c2_in_byte_2; i++) {
+            control_bit2 += get_bit(r->payload[chunk], c2_bit[i]);
+        }
+        for (i = first_c2_in_byte_2; i < 5; i++) {
+            control_bit2 += get_bit(r->payload[chunk + 1], c2_bit[i]);
+        }
+
+        /* Compute control_bit3 */
+        for (i = first_c3_in_byte_2; i < 5; i++) {
+            control_bit3 += get_bit(r->payload[chunk + 1], c3_bit[i]);
+        }
+
+        /* Check if we actually have an error or not */
+        control_bit0 %= 2; control_bit1 %= 2;
+        control_bit2 %= 2; control_bit3 %= 2;
+
+        error = control_bit0;
+        if (control_bit1) error += control_bit1 << 1;
+        if (control_bit2) error += control_bit2 << 2;
+        if (control_bit3) error += control_bit3 << 3;
+        /* If needed, correct the error */
+        if (error) {
+            corrected++;
+            /* Correct the first byte */
+            if (error <= 4) { r->payload[chunk] ^= (1 << (4 - error)); }
+            /* Correct the second byte */
+            else if (error > 4 && error <= 12) { r->payload[chunk + 1] ^= (1 << (12 - error)); }
+        }
+
+        /* Decode the bytes */
+        int bit_value;
+        for (i = 0; i < first_data_in_byte_2; i++) {
+            bit_value = get_bit(r->payload[chunk], data_bits[i]);
+            if (bit_value) decoded_message[chunk / 2] |= (1 << (8 - i - 1));
+            else decoded_message[chunk / 2] &= ~(1 << (8 - i - 1));
+        }
+        for (i = first_data_in_byte_2; i < 8; i++) {
+            bit_value = get_bit(r->payload[chunk + 1], data_bits[i]);
+            if (bit_value) decoded_message[chunk / 2] |= (1 << (8 - i - 1));
+            else decoded_message[chunk / 2] &= ~(1 << (8 - i - 1));
+        }
+    }
+
+    /* Every syndrome other than 0 is one flipped bit */
+    tune_errors(8 * r->len, corrected);
+
+    /* Set the new length and memcpy in r->payload the decoded message */
+    r->len /= 2;
+    memcpy(r->payload, decoded_message, r->len);
+
+    return 1;
+}
+
+static void encode(msg* t)
+{
+    char encoded_message[t->len * 2];
+    int i, chunk, bit_value, j;
+    int control_bit0, control_bit1, control_bit2, control_bit3;
+    char byte1 = 0, byte2 = 0;
+
+    /* Take each byte and encode it using hamming coding method */
+    /* At the end, 1 byte becomes 2 bytes */
+    for (chunk = 0, j = 0; chunk < t->len; chunk++, j += 2) {
+
+        /* Init byte1 and byte2 */
+        for (i = 0; i < 8; i++) {
+            byte1 &= ~(1 << i);
+            byte2 &= ~(1 << i);
+        }
+
+        /* Fill the 2nd byte with data bits */
+        for (i = 0; i < 4; i++) {
+            bit_value = get_bit(t->payload[chunk], i);
+            if (bit_value) byte2 |= (1 << i);
+            else byte2 &= ~(1 << i);
+        }
+        for (i = 4; i < 7; i++) {
+            bit_value = get_bit(t->payload[chunk], i);
+            if (bit_value) byte2 |= (1 << (i + 1));
+            else byte2 &= ~(1 << (i + 1));
+        }
+
+        /* Fill the 1st byte with data bits */
+        bit_value = get_bit(t->payload[chunk], 7);
+        if (bit_value) byte1 |= (1 << 1);
+        else byte1 &= ~(1 << 1);
+
+        /* Calculate control bits and insert them into bytes1 and byte2 */
+        control_bit0 = control_bit1 = control_bit2 = control_bit3 = 0;
+
+        /* Compute control_bit0 */
+        for (i = 0; i < first_c0_in_byte_2; i++) {
+            control_bit0 += get_bit(byte1, c0_bit[i]);
+        }
+        for (i = first_c0_in_byte_2; i < 6; i++) {
+            control_bit0 += get_bit(byte2, c0_bit[i]);
+        }
+
+        /* Compute control_bit1 */
+        for (i = 0; i < first_c1_in_byte_2; i++) {
+            control_bit1 += get_bit(byte1, c1_bit[i]);
+        }
+        for (i = first_c1_in_byte_2; i < 6; i++) {
+            control_bit1 += get_bit(byte2, c1_bit[i]);
+        }
+
+        /* Compute control_bit2 */
+        for (i = 0; i < first_c2_in_byte_2; i++) {
+            control_bit2 += get_bit(byte1, c2_bit[i]);
+        }
+        for (i = first_c2_in_byte_2; i < 5; i++) {
+            control_bit2 += get_bit(byte2, c2_bit[i]);
+        }
+
+        /* Compute control_bit3 */
+        for (i = first_c3_in_byte_2; i < 5; i++) {
+            control_bit3 += get_bit(byte2, c3_bit[i]);
+        }
+
+        control_bit0 %= 2; control_bit1 %= 2;
+        control_bit2 %= 2; control_bit3 %= 2;
+
+        if (control_bit0) byte1 |= (1 << 3);
+        else byte1 &= ~(1 << 3);
+
+        if (control_bit1) byte1 |= (1 << 2);
+        else byte1 &= ~(1 << 2);
+
+        if (control_bit2) byte1 |= (1 << 0);
+        else byte1 &= ~(1 << 0);
+
+        if (control_bit3) byte2 |= (1 << 4);
+        else byte2 &= ~(1 << 4);
+
+        encoded_message[chunk * 2] = byte1; encoded_message[chunk * 2 + 1] = byte2;
+    }
+
+    /* Set the new length and memcpy the encoded message */
+    t->len = t->len * 2;
+    memcpy(t->payload, encoded_message, t->len);
+}
+
+/* Normal mode: data goes as it is */
+static int normal_capacity(int msgsize) { return msgsize; }
+static void normal_seal(msg *t) { }
+static int normal_open(msg *r, msg *t) { return 1; }
+static int normal_confirm(msg *r, msg *t) { return 1; }
+
+/* Parity mode: byte 0 carries the parity of the rest. A bad package
+   is NACKed until it comes right; the peer NACKs ours the same way. */
+static int parity_capacity(int msgsize) { return msgsize - 1; }
+
+static void parity_seal(msg *t)
+{
+    /* Get the parity of bytes starting with byte 1 */
+    int parity = get_parity(t->payload, 1, t->len);
+    /* Set the parity on the rightmost bit on the 0 byte */
+    set_parity(t->payload, 0, parity);
+}
+
+static int parity_open(msg *r, msg *t)
+{
+    /* While the received package has not the right parity, we take care of that */
+    if (!is_parity_correct(r) && wait_until_correct_parity(r, t) < 0) return -1;
+    tune_errors(8 * r->len, 0);
+
+    return 1;
+}
+
+static int parity_confirm(msg *r, msg *t)
+{
+    /* In case the client sended NACK, send the package over and over again */
+    return wait_until_ack(r, t);
+}
+
+/* Hamming mode: every byte travels as a 2 byte codeword */
+static int hamming_capacity(int msgsize) { return msgsize / 2; }
+static void hamming_seal(msg *t) { encode(t); }
+static int hamming_open(msg *r, msg *t) { return detect_correct_errors_and_decode(r); }
+
+const codec normal_codec = {
+    "normal", 0, 0, normal_capacity, normal_seal, normal_open, normal_confirm
+};
+
+const codec parity_codec = {
+    "parity", 1, 1, parity_capacity, parity_seal, parity_open, parity_confirm
+};
+
+const codec hamming_codec = {
+    "hamming", 0, 0, hamming_capacity, hamming_seal, hamming_open, normal_confirm
+};
+
+static const codec *codecs[] = { &normal_codec, &parity_codec, &hamming_codec };
+
+const codec *find_codec(const char *name)
+{
+    int i;
+    for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if (!strcmp(codecs[i]->name, name)) return codecs[i];
+    }
+
+    return NULL;
+}
+
+int send_ack(msg *t)
+{
+    sprintf(t->payload, ACK);
+    t->len = strlen(ACK) + 1;
+    return send_message(t);
+}
+
+/* Fill t with a string as the data of a package, ready to be sent */
+void put_string(const codec *c, msg *t, const char *s)
+{
+    strcpy(codec_data(c, t), s);
+    t->len = c->header + strlen(s);
+    c->seal(t);
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Send t and wait until the client confirms it */
+int send_confirmed(const codec *c, msg *t)
+{
+    msg r;
+
+    return send_answered(c, t, &r);
+}
+
+/* The same, leaving the client's confirmation in r */
+int send_answered(const codec *c, msg *t, msg *r)
+{
+    int res;
+    pace_ticket ticket;
+
+    /* Leave when the pacer says so, the time it takes is not the package's */
+    pace_send(&ticket, wire_size(t));
+    double start = seconds();
+
+    int size = send_message(t);
+    if (size < 0) {
+        pace_answer(&ticket, 0, 0);
+        return -1;
+    }
+
+    res = recv_message(r);
+    pace_answer(&ticket, res >= 0, recv_marked());
+    if (res < 0) return -1;
+    tune_timing(size, seconds() - start);
+
+    return c->confirm(r, t);
+}
+
+/* Receive a package and let the codec check it */
+int recv_opened(const codec *c, msg *r, msg *t)
+{
+    int res = recv_message(r);
+    if (res < 0) return -1;
+
+    return c->open(r, t);
+}
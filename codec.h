@@ -0,0 +1,56 @@
+#ifndef CODEC
+#define CODEC
+
+#include "lib.h"
+
+/* Confirmations */
+#define ACK "ACK"
+#define NACK "NACK"
+
+/* A codec is the line coding of one running mode: how a chunk of data
+   is laid out in a package and how a received package is checked.
+
+   Data always sits at payload + header. Before seal(), len counts the
+   header plus the data bytes; after open(), the same holds for the
+   received package. */
+typedef struct {
+    const char *name;
+
+    /* Bytes in front of the data in every package */
+    int header;
+
+    /* 1 if a damaged package is sent again rather than repaired */
+    int retransmits;
+
+    /* Data bytes carried by a package of msgsize bytes */
+    int (*capacity)(int msgsize);
+
+    /* Turn a package holding plain data into what goes on the wire */
+    void (*seal)(msg *t);
+
+    /* Check (and if needed repair or ask again for) a received package.
+       t is scratch space for whatever has to be sent back meanwhile. */
+    int (*open)(msg *r, msg *t);
+
+    /* Handle the peer's answer r to the package t we sent */
+    int (*confirm)(msg *r, msg *t);
+} codec;
+
+extern const codec normal_codec;
+extern const codec parity_codec;
+extern const codec hamming_codec;
+
+/* Look up a codec by the name used on the command line */
+const codec *find_codec(const char *name);
+
+/* Package helpers shared by the commands */
+int send_ack(msg *t);
+void put_string(const codec *c, msg *t, const char *s);
+int send_confirmed(const codec *c, msg *t);
+int send_answered(const codec *c, msg *t, msg *r);
+int recv_opened(const codec *c, msg *r, msg *t);
+
+#define codec_data(c, m) ((m)->payload + (c)->header)
+#define codec_data_len(c, m) ((m)->len - (c)->header)
+
+#endif
@@ -0,0 +1,121 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "digest.h"
+#include "hash.h"
+#include "keycache.h"
+
+/* Files whose digest is kept */
+#define DIGEST_CACHE 256
+
+static file_digest cache[DIGEST_CACHE];
+static keycache_slot slots[DIGEST_CACHE];
+static keycache hashed = KEYCACHE_INIT(slots);
+
+typedef struct {
+    int fd;
+    long long size;
+    int leaves;
+    /* Next leaf nobody took yet */
+    int next;
+    uint64_t *hashes;
+    int failed;
+} job;
+
+static void *hash_leaves(void *argument)
+{
+    job *j = argument;
+    char *buf = malloc(DIGEST_LEAF);
+    int leaf;
+
+    if (buf == NULL) {
+        j->failed = 1;
+        return NULL;
+    }
+
+    while ((leaf = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->leaves) {
+        long long offset = (long long)leaf * DIGEST_LEAF;
+        int len = j->size - offset < DIGEST_LEAF ? j->size - offset : DIGEST_LEAF;
+        int got = 0, n;
+
+        while (got < len && (n = pread(j->fd, buf + got, len - got, offset + got)) > 0) got += n;
+        if (got < len) j->failed = 1;
+
+        j->hashes[leaf] = xxh64(buf, got, 0);
+    }
+    free(buf);
+
+    return NULL;
+}
+
+static int compute(file_digest *d, int fd, long long size)
+{
+    job j;
+    pthread_t threads[DIGEST_THREADS];
+    int i, n;
+
+    j.fd = fd;
+    j.size = size;
+    j.leaves = (size + DIGEST_LEAF - 1) / DIGEST_LEAF;
+    j.next = 0;
+    j.failed = 0;
+    j.hashes = malloc((j.leaves + 1) * sizeof(uint64_t));
+    if (j.hashes == NULL) return -1;
+
+    /* Small files are not worth a thread */
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > DIGEST_THREADS) n = DIGEST_THREADS;
+    if (n > j.leaves) n = j.leaves;
+    if (n <= 1) {
+        hash_leaves(&j);
+        n = 0;
+    }
+
+    posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+    for (i = 0; i < n; i++) pthread_create(&threads[i], NULL, hash_leaves, &j);
+    for (i = 0; i < n; i++) pthread_join(threads[i], NULL);
+
+    if (j.leaves <= 1) {
+        /* One leaf is the whole file, and nothing is XXH64 of nothing */
+        d->hash = j.leaves ? j.hashes[0] : xxh64("", 0, 0);
+    } else {
+        d->hash = xxh64((const char *)j.hashes, j.leaves * sizeof(uint64_t), size);
+    }
+    free(j.hashes);
+
+    return j.failed ? -1 : 1;
+}
+
+const file_digest *digest_lookup(const char *path)
+{
+    struct stat st;
+    file_digest *d;
+    int hit;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    d = &cache[keycache_find(&hashed, &st, &hit)];
+    if (hit) {
+        close(fd);
+        return d;
+    }
+
+    /* Not hashed yet, or changed since: (re)compute */
+    int res = compute(d, fd, st.st_size);
+    close(fd);
+    if (res < 0) return NULL;
+
+    d->mtime = st.st_mtim.tv_sec;
+    d->size = st.st_size;
+    keycache_store(&hashed, d - cache, &st);
+
+    return d;
+}
@@ -0,0 +1,27 @@
+#ifndef DIGEST
+#define DIGEST
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Strong hash of a whole file, so that a client can tell whether it
+   changed without fetching it. The file is cut in leaves of
+   DIGEST_LEAF bytes hashed with XXH64 on several threads at once; the
+   digest is the XXH64 of the leaf hashes (little endian uint64, seeded
+   with the file size). A file of one leaf or less is simply the XXH64
+   of its bytes. */
+
+#define DIGEST_LEAF (1024 * 1024)
+#define DIGEST_THREADS 8
+
+typedef struct {
+    time_t mtime;
+    long long size;
+    uint64_t hash;
+} file_digest;
+
+/* The digest of a file, computed on first use and kept while its inode,
+   mtime and size stay the same. NULL if the file cannot be read. */
+const file_digest *digest_lookup(const char *path);
+
+#endif
@@ -0,0 +1,208 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "fcache.h"
+#include "hash.h"
+#include "keycache.h"
+
+/* What makes a cached descriptor or its stat out of date */
+#define FCACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+typedef struct {
+    /* XXH64 of the path, 0 for a free entry or one no longer looked up */
+    uint64_t key;
+    char *path;
+    int fd;
+    int wd;
+    struct stat st;
+    /* Transfers using fd; a dropped entry is closed by the last one */
+    int refs;
+    /* The file changed since st was taken */
+    int restat;
+    unsigned long used;
+} cached_file;
+
+static cached_file cache[FCACHE_SIZE];
+static unsigned long ticks = 0;
+static char cwd[PATH_MAX];
+/* -1 until the first use, -2 if inotify is not available */
+static int watch = -1;
+
+/* Parallel range transfers open files from their own threads */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Forget the path of an entry; its descriptor stays while in use */
+static void drop(cached_file *e)
+{
+    if (e->wd >= 0) inotify_rm_watch(watch, e->wd);
+    e->wd = -1;
+    e->key = 0;
+    free(e->path);
+    e->path = NULL;
+
+    if (e->refs == 0 && e->fd >= 0) {
+        close(e->fd);
+        e->fd = -1;
+    }
+}
+
+/* Apply what inotify reported since the last look */
+static void drain_events()
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int n, i;
+
+    while ((n = read(watch, events, sizeof(events))) > 0) {
+        char *p;
+        for (p = events; p < events + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            for (i = 0; i < FCACHE_SIZE; i++) {
+                cached_file *e = &cache[i];
+                if (!e->key || e->wd != ev->wd) continue;
+
+                if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+                    e->wd = -1;
+                    drop(e);
+                } else {
+                    e->restat = 1;
+                }
+            }
+        }
+    }
+}
+
+static void init()
+{
+    int i;
+
+    for (i = 0; i < FCACHE_SIZE; i++) {
+        cache[i].fd = -1;
+        cache[i].wd = -1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+
+    watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch < 0) watch = -2;
+}
+
+/* Still the file the path names? Only asked without inotify. */
+static int still_valid(cached_file *e)
+{
+    struct stat st;
+    file_key k;
+
+    if (stat(e->path, &st) < 0) return 0;
+    file_key_of(&k, &e->st);
+    return file_key_matches(&k, &st);
+}
+
+int fcache_open(const char *path, struct stat *st)
+{
+    char full[2 * PATH_MAX];
+    cached_file *e = NULL, *victim = NULL;
+    int i;
+
+    pthread_mutex_lock(&lock);
+    if (watch == -1) init();
+    if (watch >= 0) drain_events();
+
+    if (path[0] == '/') snprintf(full, sizeof(full), "%s", path);
+    else snprintf(full, sizeof(full), "%s/%s", cwd, path);
+    uint64_t key = xxh64(full, strlen(full), 0);
+    if (key == 0) key = 1;
+
+    for (i = 0; i < FCACHE_SIZE; i++) {
+        if (cache[i].key == key && !strcmp(cache[i].path, full)) {
+            e = &cache[i];
+            break;
+        }
+        /* The least recently used entry nobody reads from */
+        if (cache[i].refs == 0 && (victim == NULL || cache[i].used < victim->used))
+            victim = &cache[i];
+    }
+
+    if (e != NULL && watch < 0 && !still_valid(e)) {
+        drop(e);
+    } else if (e != NULL && e->restat && fstat(e->fd, &e->st) == 0) {
+        e->restat = 0;
+        if (e->st.st_nlink == 0) drop(e);
+    }
+    if (e != NULL && !e->key) {
+        /* Dropped just now, its entry is the one to reuse if free */
+        if (e->refs == 0) victim = e;
+        e = NULL;
+    }
+
+    if (e == NULL) {
+        int fd = open(full, O_RDONLY | O_CLOEXEC);
+        struct stat fst;
+        if (fd < 0 || fstat(fd, &fst) < 0) {
+            if (fd >= 0) close(fd);
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+
+        /* Every entry busy: the caller gets a descriptor of its own */
+        if (victim == NULL) {
+            pthread_mutex_unlock(&lock);
+            *st = fst;
+            return fd;
+        }
+
+        e = victim;
+        if (e->key) drop(e);
+        e->key = key;
+        e->path = strdup(full);
+        e->fd = fd;
+        e->st = fst;
+        e->restat = 0;
+        e->wd = watch >= 0 ? inotify_add_watch(watch, full, FCACHE_EVENTS) : -1;
+    }
+
+    e->refs++;
+    e->used = ++ticks;
+    *st = e->st;
+    int fd = e->fd;
+    pthread_mutex_unlock(&lock);
+
+    return fd;
+}
+
+void fcache_release(int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < FCACHE_SIZE; i++) {
+        cached_file *e = &cache[i];
+        if (e->fd != fd || e->refs == 0) continue;
+
+        e->refs--;
+        if (e->refs == 0 && !e->key) {
+            close(e->fd);
+            e->fd = -1;
+        }
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    pthread_mutex_unlock(&lock);
+
+    /* Not cached, it was the caller's own */
+    close(fd);
+}
+
+void fcache_chdir()
+{
+    pthread_mutex_lock(&lock);
+    if (watch == -1) init();
+    if (getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+    pthread_mutex_unlock(&lock);
+}
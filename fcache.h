@@ -0,0 +1,24 @@
+#ifndef FCACHE
+#define FCACHE
+
+#include <sys/stat.h>
+
+/* Open files kept for reading, with their fstat, so that transfers of
+   the same few files do not pay for a path lookup and an open every
+   time. Entries are keyed by path within the session's directory and
+   dropped when inotify says the file was modified, moved or deleted;
+   where inotify is not available, by checking the inode, mtime and
+   size of the path on every use. Descriptors are shared, so readers
+   must use pread. */
+
+#define FCACHE_SIZE 256
+
+/* A read only descriptor for path and its stat in *st, or -1. Every
+   successful call is paired with a fcache_release. */
+int fcache_open(const char *path, struct stat *st);
+void fcache_release(int fd);
+
+/* The session changed directory, relative paths mean other files now */
+void fcache_chdir();
+
+#endif
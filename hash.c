@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "hash.h"
+
+/* Added to every byte so that runs of zeros still move the sums */
+#define CHAR_OFFSET 31
+
+uint32_t rolling_checksum(const char *buf, int len)
+{
+    uint32_t s1 = 0, s2 = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        s1 += (unsigned char)buf[i] + CHAR_OFFSET;
+        s2 += s1;
+    }
+
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+uint32_t rolling_roll(uint32_t sum, char out, char in, int len)
+{
+    uint32_t s1 = sum & 0xffff, s2 = sum >> 16;
+
+    s1 += (unsigned char)in - (unsigned char)out;
+    s2 += s1 - len * ((unsigned char)out + CHAR_OFFSET);
+
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * P1 + P4;
+}
+
+/* One 32 byte stripe into the four lanes */
+static inline void xxh_stripe(uint64_t *v, const char *p)
+{
+    v[0] = xxh_round(v[0], read64(p));
+    v[1] = xxh_round(v[1], read64(p + 8));
+    v[2] = xxh_round(v[2], read64(p + 16));
+    v[3] = xxh_round(v[3], read64(p + 24));
+}
+
+void xxh64_reset(xxh64_state *st, uint64_t seed)
+{
+    st->total = 0;
+    st->buffered = 0;
+    st->v[0] = seed + P1 + P2;
+    st->v[1] = seed + P2;
+    st->v[2] = seed;
+    st->v[3] = seed - P1;
+}
+
+void xxh64_update(xxh64_state *st, const char *buf, int len)
+{
+    st->total += len;
+
+    /* Top up a partial stripe first */
+    if (st->buffered) {
+        int k = 32 - st->buffered < len ? 32 - st->buffered : len;
+        memcpy(st->buf + st->buffered, buf, k);
+        st->buffered += k;
+        buf += k;
+        len -= k;
+        if (st->buffered < 32) return;
+        xxh_stripe(st->v, st->buf);
+        st->buffered = 0;
+    }
+
+    for (; len >= 32; buf += 32, len -= 32) xxh_stripe(st->v, buf);
+
+    memcpy(st->buf, buf, len);
+    st->buffered = len;
+}
+
+uint64_t xxh64_digest(const xxh64_state *st)
+{
+    const char *p = st->buf;
+    int len = st->buffered;
+    uint64_t h;
+
+    if (st->total >= 32) {
+        h = rotl(st->v[0], 1) + rotl(st->v[1], 7) +
+            rotl(st->v[2], 12) + rotl(st->v[3], 18);
+        h = xxh_merge(h, st->v[0]);
+        h = xxh_merge(h, st->v[1]);
+        h = xxh_merge(h, st->v[2]);
+        h = xxh_merge(h, st->v[3]);
+    } else {
+        /* v[2] still holds the seed */
+        h = st->v[2] + P5;
+    }
+    h += st->total;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= (unsigned char)*p * P5;
+        h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint64_t xxh64(const char *buf, int len, uint64_t seed)
+{
+    xxh64_state st;
+
+    xxh64_reset(&st, seed);
+    xxh64_update(&st, buf, len);
+
+    return xxh64_digest(&st);
+}
@@ -0,0 +1,27 @@
+#ifndef HASH
+#define HASH
+
+#include <stdint.h>
+
+/* Weak rolling checksum in the style of rsync (two 16 bit Adler-like
+   sums). It can slide over data one byte at a time. */
+uint32_t rolling_checksum(const char *buf, int len);
+
+/* Slide the window of a checksum over len bytes by one byte: out leaves,
+   in enters */
+uint32_t rolling_roll(uint32_t sum, char out, char in, int len);
+
+/* XXH64, the strong checksum */
+typedef struct {
+    uint64_t total;
+    uint64_t v[4];
+    char buf[32];
+    int buffered;
+} xxh64_state;
+
+void xxh64_reset(xxh64_state *st, uint64_t seed);
+void xxh64_update(xxh64_state *st, const char *buf, int len);
+uint64_t xxh64_digest(const xxh64_state *st);
+uint64_t xxh64(const char *buf, int len, uint64_t seed);
+
+#endif
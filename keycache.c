@@ -0,0 +1,45 @@
+#include "keycache.h"
+
+void file_key_of(file_key *k, const struct stat *st)
+{
+    k->dev = st->st_dev;
+    k->ino = st->st_ino;
+    k->mtime = st->st_mtim;
+    k->size = st->st_size;
+}
+
+int file_key_matches(const file_key *k, const struct stat *st)
+{
+    return k->dev == st->st_dev && k->ino == st->st_ino &&
+           k->mtime.tv_sec == st->st_mtim.tv_sec && k->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           k->size == st->st_size;
+}
+
+int keycache_find(keycache *k, const struct stat *st, int *hit)
+{
+    int i;
+
+    *hit = 0;
+    for (i = 0; i < k->size; i++) {
+        keycache_slot *s = &k->slots[i];
+        if (s->valid && s->key.dev == st->st_dev && s->key.ino == st->st_ino) {
+            /* Changed since: worked out again in the same entry */
+            *hit = file_key_matches(&s->key, st);
+            break;
+        }
+    }
+
+    if (i == k->size) {
+        i = k->victim;
+        k->victim = (k->victim + 1) % k->size;
+    }
+    if (!*hit) k->slots[i].valid = 0;
+
+    return i;
+}
+
+void keycache_store(keycache *k, int entry, const struct stat *st)
+{
+    file_key_of(&k->slots[entry].key, st);
+    k->slots[entry].valid = 1;
+}
@@ -0,0 +1,44 @@
+#ifndef KEYCACHE
+#define KEYCACHE
+
+#include <sys/stat.h>
+
+/* Tables of what is worked out from whole files (chunk indexes,
+   digests), one entry per file. A file is known by its device and
+   inode, and what was worked out holds while its mtime and size stay
+   the same. A full table reuses its entries round robin. */
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    long long size;
+} file_key;
+
+void file_key_of(file_key *k, const struct stat *st);
+
+/* 1 if st is the file of k, unchanged since */
+int file_key_matches(const file_key *k, const struct stat *st);
+
+typedef struct {
+    file_key key;
+    int valid;
+} keycache_slot;
+
+typedef struct {
+    keycache_slot *slots;
+    int size;
+    /* Next slot to reuse */
+    int victim;
+} keycache;
+
+/* A keycache over a static array of slots, the entries themselves are
+   the caller's array of the same size */
+#define KEYCACHE_INIT(slots) { slots, sizeof(slots) / sizeof((slots)[0]), 0 }
+
+/* The entry of the file st describes. Sets *hit if it is up to date;
+   otherwise it is the entry to fill, invalid until keycache_store(). */
+int keycache_find(keycache *k, const struct stat *st, int *hit);
+void keycache_store(keycache *k, int entry, const struct stat *st);
+
+#endif
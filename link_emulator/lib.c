@@ -1,18 +1,66 @@
 #include <arpa/inet.h>
 #include <poll.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "lib.h"
 
-struct sockaddr_in addr_local, addr_remote;
-int s;
-struct pollfd fds[1];
+//shared memory transport, for peers on the same host: two rings of
+//message slots, one per direction, in a shared memory object
+#define SHM_SLOTS	64
+#define SHM_MAGIC	0x53484d31
+
+typedef struct {
+	//slots published and slots taken, the futex words of the ring
+	unsigned head, tail;
+	//set while the receiver (or the sender, when full) sleeps
+	int reader_sleeps, writer_sleeps;
+	int bytes[SHM_SLOTS];
+	char slots[SHM_SLOTS][sizeof(msg)];
+} shm_ring;
+
+typedef struct {
+	unsigned magic;
+	//1 once the second peer took its side
+	int claimed;
+	shm_ring rings[2];
+} shm_link;
+
+//every thread has its own connection, so a program can run several flows
+__thread struct sockaddr_in addr_local, addr_remote;
+__thread int s;
+__thread struct pollfd fds[1];
+
+//payload bytes of every datagram in this session
+__thread int msgsize = MSGSIZE;
+//1 if datagrams end where the message does instead of at msgsize
+__thread int trim = 0;
+
+//ECN: the link marks a datagram Congestion Experienced when its queue
+//builds, and the receiver echoes the mark with ECN_ECHO on the next
+//message it sends. 1 if the last message received was marked CE or
+//echoed a mark, and if the next one sent has to echo a CE.
+__thread int marked = 0;
+__thread int echo = 0;
+
+//the shared memory link when init was given "shm:<name>", else NULL
+__thread shm_link *shm = NULL;
+__thread shm_ring *shm_out, *shm_in;
 
 void set_local_port(int port)
 {
@@ -22,46 +70,308 @@ void set_local_port(int port)
 	addr_local.sin_addr.s_addr = htonl(INADDR_ANY);
 }
 
-void set_remote(char *ip, int port)
+static int remote_address(char *ip, int port)
 {
 	memset((char *)&addr_remote, 0, sizeof(addr_remote));
 	addr_remote.sin_family = AF_INET;
 	addr_remote.sin_port = htons(port);
 	if (inet_aton(ip, &addr_remote.sin_addr) == 0) {
 		perror("inet_aton failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+void set_remote(char *ip, int port)
+{
+	if (remote_address(ip, port) < 0)
 		exit(1);
+}
+
+static int futex(unsigned *word, int op, unsigned value, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+//map the object /<name>-<port>: the peer that creates it takes ring 0
+//for sending, the one that finds it takes ring 1. An object already
+//claimed by two peers is a leftover, it is replaced. Returns 0, or -1
+//if the object cannot be had.
+static int shm_init(char *name, int port)
+{
+	char path[NAME_MAX];
+	int fd, first;
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/%s-%d", name, port);
+	for (;;) {
+		first = 1;
+		fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST) {
+			first = 0;
+			fd = shm_open(path, O_RDWR, 0600);
+		}
+		if (fd < 0) {
+			perror("shm_open failed");
+			return -1;
+		}
+
+		if (first) {
+			if (ftruncate(fd, sizeof(shm_link)) < 0) {
+				perror("ftruncate failed");
+				close(fd);
+				shm_unlink(path);
+				return -1;
+			}
+		} else {
+			//wait for the creator to size it
+			while (fstat(fd, &st) == 0 && st.st_size < sizeof(shm_link))
+				usleep(1000);
+		}
+
+		shm = mmap(NULL, sizeof(shm_link), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (shm == MAP_FAILED) {
+			perror("mmap failed");
+			shm = NULL;
+			return -1;
+		}
+
+		if (first) {
+			memset(shm, 0, offsetof(shm_link, rings));
+			memset(&shm->rings[0], 0, offsetof(shm_ring, slots));
+			memset(&shm->rings[1], 0, offsetof(shm_ring, slots));
+			__atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+			break;
+		}
+
+		while (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC)
+			usleep(1000);
+		if (__atomic_exchange_n(&shm->claimed, 1, __ATOMIC_ACQ_REL) == 0) {
+			//both peers have it mapped, the name is not needed anymore
+			shm_unlink(path);
+			break;
+		}
+		munmap(shm, sizeof(shm_link));
+		shm_unlink(path);
 	}
+
+	shm_out = &shm->rings[first ? 0 : 1];
+	shm_in = &shm->rings[first ? 1 : 0];
+	return 0;
 }
 
-void init(char *remote, int REMOTE_PORT)
+//wait until *word moves away from value; 0 if timeout (ms, -1 for
+//none) passed first. sleeps is raised while waiting, so that the peer
+//knows to wake us.
+static int shm_wait(unsigned *word, unsigned value, int *sleeps, int timeout)
+{
+	struct timespec ts, *tp = NULL;
+	int res;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		tp = &ts;
+	}
+
+	__atomic_store_n(sleeps, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(word, __ATOMIC_SEQ_CST) != value) {
+		__atomic_store_n(sleeps, 0, __ATOMIC_SEQ_CST);
+		return 1;
+	}
+	res = futex(word, FUTEX_WAIT, value, tp);
+	__atomic_store_n(sleeps, 0, __ATOMIC_SEQ_CST);
+
+	return !(res < 0 && errno == ETIMEDOUT);
+}
+
+static void shm_wake(unsigned *word, int *sleeps)
+{
+	if (__atomic_load_n(sleeps, __ATOMIC_SEQ_CST))
+		futex(word, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+static int shm_send(const msg * m, int size)
+{
+	shm_ring *r = shm_out;
+	unsigned head = r->head, tail;
+
+	while (head - (tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == SHM_SLOTS)
+		shm_wait(&r->tail, tail, &r->writer_sleeps, -1);
+
+	memcpy(r->slots[head % SHM_SLOTS], m, size);
+	r->bytes[head % SHM_SLOTS] = size;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	shm_wake(&r->head, &r->reader_sleeps);
+
+	return size;
+}
+
+static int shm_recv(msg * ret, int timeout)
+{
+	shm_ring *r = shm_in;
+	unsigned tail = r->tail, head;
+
+	while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail)
+		if (!shm_wait(&r->head, head, &r->reader_sleeps, timeout))
+			return 0;
+
+	int size = r->bytes[tail % SHM_SLOTS];
+	memcpy(ret, r->slots[tail % SHM_SLOTS], size);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+	shm_wake(&r->tail, &r->writer_sleeps);
+
+	return size;
+}
+
+int try_init(char *remote, int REMOTE_PORT)
 {
+	if (!strncmp(remote, "shm:", 4))
+		return shm_init(remote + 4, REMOTE_PORT);
+
 	if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
 		perror("Error creating socket");
-		exit(1);
+		return -1;
 	}
 
 	set_local_port(0);
-	set_remote(remote, REMOTE_PORT);
+	if (remote_address(remote, REMOTE_PORT) < 0) {
+		close(s);
+		return -1;
+	}
 
 	if (bind(s, (struct sockaddr *)&addr_local, sizeof(addr_local)) == -1) {
 		perror("Failed to bind");
-		exit(1);
+		close(s);
+		return -1;
 	}
 
+	int on = 1;
+	setsockopt(s, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on));
+	marked = echo = 0;
+
 	fds[0].fd = s;
 	fds[0].events = POLLIN;
 
 	msg m;
 	send_message(&m);
+	return 0;
+}
+
+void init(char *remote, int REMOTE_PORT)
+{
+	if (try_init(remote, REMOTE_PORT) < 0)
+		exit(1);
+}
+
+void finish()
+{
+	if (shm) {
+		munmap(shm, sizeof(shm_link));
+		shm = NULL;
+		return;
+	}
+	close(s);
+}
+
+void set_msgsize(int size)
+{
+	if (size > MAX_MSGSIZE)
+		size = MAX_MSGSIZE;
+	msgsize = size;
+}
+
+int get_msgsize()
+{
+	return msgsize;
+}
+
+void set_trim(int on)
+{
+	trim = on;
+}
+
+int get_trim()
+{
+	return trim;
+}
+
+int wire_size(const msg * m)
+{
+	int size = msgsize;
+	if (trim && m->len >= 0 && m->len < msgsize)
+		size = m->len;
+
+	return offsetof(msg, payload) + size;
 }
 
 int send_message(const msg * m)
 {
-	return sendto(s, m, sizeof(msg), 0, (struct sockaddr *)&addr_remote,
-		      sizeof(addr_remote));
+	if (shm)
+		return shm_send(m, wire_size(m));
+	if (!echo)
+		return sendto(s, m, wire_size(m), 0,
+			      (struct sockaddr *)&addr_remote, sizeof(addr_remote));
+
+	//the flag goes in a len of its own, m is left as it is
+	int len = m->len | ECN_ECHO;
+	struct iovec iov[2] = {
+		{.iov_base = &len,.iov_len = sizeof(len) },
+		{.iov_base = (void *)m->payload,.iov_len = wire_size(m) - offsetof(msg, payload) },
+	};
+	struct msghdr hdr = {
+		.msg_name = &addr_remote,
+		.msg_namelen = sizeof(addr_remote),
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+
+	echo = 0;
+	return sendmsg(s, &hdr, 0);
 }
 
 int recv_message(msg * ret)
 {
-	return recvfrom(s, ret, sizeof(msg), 0, NULL, NULL);
+	if (shm)
+		return shm_recv(ret, -1);
+
+	struct iovec iov = {.iov_base = ret,.iov_len = sizeof(msg) };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr hdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *c;
+	int res = recvmsg(s, &hdr, 0);
+
+	marked = 0;
+	for (c = CMSG_FIRSTHDR(&hdr); res >= 0 && c != NULL; c = CMSG_NXTHDR(&hdr, c))
+		if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TOS
+		    && (*(unsigned char *)CMSG_DATA(c) & IPTOS_ECN_MASK) == IPTOS_ECN_CE)
+			marked = echo = 1;
+	if (res >= (int)sizeof(ret->len) && ret->len >= 0 && (ret->len & ECN_ECHO)) {
+		ret->len &= ~ECN_ECHO;
+		marked = 1;
+	}
+	return res;
+}
+
+int recv_marked()
+{
+	return marked;
+}
+
+//returns 0 if nothing arrived in timeout ms
+int recv_message_timeout(msg * ret, int timeout)
+{
+	if (shm)
+		return shm_recv(ret, timeout);
+
+	int res = poll(fds, 1, timeout);
+	if (res <= 0)
+		return res;
+	return recv_message(ret);
 }
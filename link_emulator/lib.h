@@ -1,18 +1,40 @@
 #ifndef LIB
 #define LIB
 
+/* Payload size every session starts with */
 #define MSGSIZE		1400
+/* Largest payload a session can negotiate (fits one UDP datagram) */
+#define MAX_MSGSIZE	65500
 
 typedef struct {
   int len;
-  char payload[MSGSIZE];
+  char payload[MAX_MSGSIZE];
 } msg;
 
+/* Set in len on the wire when the message echoes a congestion mark,
+   as TCP's ECE; recv_message takes it out again */
+#define ECN_ECHO	(1 << 30)
+
+/* remote is an IPv4 address, or "shm:<name>" for a peer on the same
+   host that calls init with the same name and port */
 void init(char* remote,int remote_port);
+/* The same, returning -1 instead of exiting if it cannot be done */
+int try_init(char* remote,int remote_port);
+void finish();
 void set_local_port(int port);
 void set_remote(char* ip, int port);
+void set_msgsize(int size);
+int get_msgsize();
+void set_trim(int on);
+int get_trim();
+/* Bytes send_message puts in the datagram for m */
+int wire_size(const msg* m);
 int send_message(const msg* m);
 int recv_message(msg* r);
+int recv_message_timeout(msg* r, int timeout);
+/* 1 if the last message received came through a congested queue, or
+   echoes that one we sent did (see ecn= of the link emulator) */
+int recv_marked();
 
 #endif
 
@@ -2,27 +2,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <sys/time.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "queue.h"
 #include "link.h"
 
 #define DEBUG 0
 
-int BUFFER_SIZE = 1000;
+//waits shorter than this are spun, the sleeps miss by about as much
+#define SPIN_LIMIT 50000
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+//how late clock_nanosleep wakes up here, measured at start
+long long sleep_slack = 0;
+
+//1 to run on a virtual clock that jumps from event to event instead
+//of sleeping. It only jumps once the endpoints answered every packet
+//that left the link, or were quiet for settle (ns, real time).
+int virtual_time = 0;
+long long settle = 5000000;
+unsigned long long virtual_clock = 0;
+#define NO_EVENT (~0ULL)
+
+//seeds the random numbers if not 0, so that runs repeat
+unsigned long long seed = 0;
+
+//1 for the way back to lose, corrupt, delay at random, reorder and
+//duplicate packets like the way there; 0 to only share its speed,
+//delay and queue, so that answers come back whole unless r parameters
+//say otherwise
+int symmetric = 0;
 
-int serialization_delay = 1000;
-int delay = 1000;
-int loss = 0;
-int corrupt = 0;
+volatile sig_atomic_t stop = 0;
+
+//largest datagram the link carries, bigger ones are dropped
+int mtu = sizeof(msg);
 
 #define CHANNEL_BUSY 1
 #define CHANNEL_IDLE 0
@@ -30,306 +61,943 @@ int corrupt = 0;
 #define LOCAL_PORT1 10000
 #define LOCAL_PORT2 10001
 
-pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t buffer_cond = PTHREAD_COND_INITIALIZER;
-queue *buffer;
+//pairs of ports the link listens on: pair k is LOCAL_PORT1 + 2 * k on
+//the client side and LOCAL_PORT2 + 2 * k on the server side
+#define MAX_PAIRS 32
+int pairs = 1;
+//by side, then pair
+int socks[2][MAX_PAIRS];
+struct pollfd pollfds[2][MAX_PAIRS];
+
+//1 for a link of its own for every flow, 0 for one link shared by all
+//of them, served in turn by deficit round robin
+int separate = 0;
+//bytes a flow may send in its turn on a shared link
+#define QUANTUM (offsetof(msg, payload) + MSGSIZE)
 
-struct sockaddr_in local_addr1, remote_addr1;
-struct sockaddr_in local_addr2, remote_addr2;
+//every flow seen so far. The table only grows: run_forwarding adds to
+//it under flows_lock, and looks up without the lock.
+flow flows[MAX_FLOWS];
+int nflows = 0;
+pthread_mutex_t flows_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int s1, s2;
-socklen_t sz;
+//room for a packet of mtu bytes
+int max_stride;
 
-//1 if a message was received on this link
-int link_up1 = 0;
-int link_up2 = 0;
+#define STRIDE(size) ((offsetof(packet, m) + (size) + 7) & ~7)
 
 void init_sockets()
 {
-	/*LOCAL ADDRESSES */
+	struct sockaddr_in local_addr;
+	int side, pair;
+
+	for (side = 0; side < 2; side++)
+		for (pair = 0; pair < pairs; pair++) {
+			memset((char *)&local_addr, 0, sizeof(local_addr));
+			local_addr.sin_family = AF_INET;
+			local_addr.sin_port =
+			    htons((side ? LOCAL_PORT2 : LOCAL_PORT1) + 2 * pair);
+			local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+			if ((socks[side][pair] =
+			     socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+				perror("Error creating socket");
+				exit(1);
+			}
+			//now bind
+			if (bind(socks[side][pair], (struct sockaddr *)&local_addr,
+				 sizeof(local_addr)) == -1) {
+				perror("Failed to bind");
+				exit(1);
+			}
 
-	memset((char *)&local_addr1, 0, sizeof(local_addr1));
-	local_addr1.sin_family = AF_INET;
-	local_addr1.sin_port = htons(LOCAL_PORT1);
-	local_addr1.sin_addr.s_addr = htonl(INADDR_ANY);
+			//the ECN bits of what comes in go out with it
+			int on = 1;
+			setsockopt(socks[side][pair], IPPROTO_IP, IP_RECVTOS, &on, sizeof(on));
 
-	memset((char *)&local_addr2, 0, sizeof(local_addr2));
-	local_addr2.sin_family = AF_INET;
-	local_addr2.sin_port = htons(LOCAL_PORT2);
-	local_addr2.sin_addr.s_addr = htonl(INADDR_ANY);
+			pollfds[side][pair].fd = socks[side][pair];
+			pollfds[side][pair].events = POLLIN;
+		}
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
 
-	if ((s1 = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-		perror("Error creating socket");
-		exit(1);
+//the flow of a datagram from addr, on a side of a pair of ports. -1 if
+//the peer is new, its first datagram only tells where it is: it joins
+//the first flow of the same ports that waits for a peer on its side,
+//or starts a flow of its own.
+int find_flow(int side, int pair, const struct sockaddr_in *addr)
+{
+	int i, n = __atomic_load_n(&nflows, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i++)
+		if (flows[i].pair == pair
+		    && __atomic_load_n(&flows[i].up[side], __ATOMIC_ACQUIRE)
+		    && same_addr(&flows[i].addr[side], addr))
+			return i;
+
+	pthread_mutex_lock(&flows_lock);
+	for (i = 0; i < nflows; i++)
+		if (flows[i].pair == pair && !flows[i].up[side])
+			break;
+	if (i == nflows && nflows == MAX_FLOWS) {
+		pthread_mutex_unlock(&flows_lock);
+		printf("Dropped packet, more than %d flows\n", MAX_FLOWS);
+		return -1;
 	}
-	//now bind
-	if (bind(s1, (struct sockaddr *)&local_addr1, sizeof(local_addr1)) ==
-	    -1) {
-		perror("Failed to bind s1");
-		exit(1);
+
+	flows[i].pair = pair;
+	flows[i].addr[side] = *addr;
+	__atomic_store_n(&flows[i].up[side], 1, __ATOMIC_RELEASE);
+	if (i == nflows)
+		__atomic_store_n(&nflows, nflows + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&flows_lock);
+
+#if DEBUG
+	printf("Flow %d is up on side %d, remote addr is %s port %d\n", i,
+	       side, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+#endif
+
+	return -1;
+}
+
+//receive the next datagram going side to side into p, from the pairs
+//of ports in turn. Returns 0, or -1 on error.
+int receive_packet(int side, int *next_pair, packet * p)
+{
+	struct sockaddr_in from;
+	struct iovec iov = {.iov_base = &p->m,.iov_len = mtu };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr hdr = {
+		.msg_name = &from,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+	};
+	struct cmsghdr *c;
+	int pair, tries;
+
+	while (1) {
+		p->size = -1;
+		for (tries = 0; tries < pairs && p->size < 0; tries++) {
+			pair = *next_pair;
+			*next_pair = (pair + 1) % pairs;
+			hdr.msg_namelen = sizeof(from);
+			hdr.msg_controllen = sizeof(control);
+			p->size = recvmsg(socks[side][pair], &hdr,
+					  MSG_TRUNC | (pairs > 1 ? MSG_DONTWAIT : 0));
+			if (p->size < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+		}
+		if (p->size < 0) {
+			//nothing on any pair, wait for one
+			poll(pollfds[side], pairs, -1);
+			continue;
+		}
+
+		p->flow = find_flow(side, pair, &from);
+		if (p->flow < 0)
+			continue;
+		p->ecn = 0;
+		for (c = CMSG_FIRSTHDR(&hdr); c != NULL; c = CMSG_NXTHDR(&hdr, c))
+			if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TOS)
+				p->ecn = *(unsigned char *)CMSG_DATA(c) & IPTOS_ECN_MASK;
+		if (p->size <= mtu)
+			return 0;
+
+		//does not fit on the link
+		printf("Dropped packet of %d bytes, mtu is %d\n", p->size, mtu);
 	}
+}
+
+//send p to the peer of its flow across from where it came in
+int send_packet(direction * d, const packet * p)
+{
+	flow *f = &flows[p->flow];
+	int side = !d->side;
 
-	if ((s2 = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-		perror("Error creating socket 2");
-		exit(1);
+	if (!__atomic_load_n(&f->up[side], __ATOMIC_ACQUIRE)) {
+		printf("Dropped packet, no peer on port %d yet\n",
+		       (side ? LOCAL_PORT2 : LOCAL_PORT1) + 2 * f->pair);
+		return 0;
 	}
+	if (!p->ce && !p->ecn)
+		return sendto(socks[side][f->pair], &p->m, p->size, 0,
+			      (struct sockaddr *)&f->addr[side], sizeof(f->addr[side]));
+
+	//marked: the ECN bits of the IP header say so, as a router would
+	//set them. Endpoints see them with IP_RECVTOS and echo them in the
+	//message (see lib.c); marks from before pass as they came.
+	struct iovec iov = {.iov_base = (void *)&p->m,.iov_len = p->size };
+	char control[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct msghdr hdr = {
+		.msg_name = &f->addr[side],
+		.msg_namelen = sizeof(f->addr[side]),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *c = CMSG_FIRSTHDR(&hdr);
+
+	c->cmsg_level = IPPROTO_IP;
+	c->cmsg_type = IP_TOS;
+	c->cmsg_len = CMSG_LEN(sizeof(int));
+	*(int *)CMSG_DATA(c) = p->ce ? IPTOS_ECN_CE : p->ecn;
+	return sendmsg(socks[side][f->pair], &hdr, 0);
+}
+
+//the way from port 1 to port 2 and back, by default the same
+//both ways: 1 ms for a full datagram, 1 ms of delay and a drop tail
+//queue of 1000 full datagrams. CoDel's target and interval are those
+//of RFC 8289, the policer lets 10 full datagrams through back to back.
+direction forward = {
+	.name = "",
+	.byte_time = 1000000.0 / (offsetof(msg, payload) + MSGSIZE),
+	.delay = 1000000,
+	.to_good = 100,
+	.bad_loss = 100,
+	.queue_limit = 1000 * (offsetof(msg, payload) + MSGSIZE),
+	.red_max_p = 10,
+	.target = 5000000,
+	.interval = 100000000,
+	.burst = 10 * (offsetof(msg, payload) + MSGSIZE),
+	.side = 0,
+};
+direction reverse = {
+	.name = "reverse ",
+	.side = 1,
+};
+
+//room for what the queue holds and what is in flight over the delay,
+//twice over for the headers of small packets. A packet is freed only
+//after the ones that came before it, and on a shared link those of a
+//flow wait while the others have their turns: count on twice as much.
+//Separate links get twice that for every pair of ports, room for a
+//couple of flows on each.
+void init_direction(direction * d)
+{
+	long long in_flight = d->delay / d->byte_time;
+
+	max_stride = STRIDE(mtu);
+	d->arena_size = 2 * (d->queue_limit + in_flight);
+	d->arena_size *= separate ? 4 * pairs : 2;
+	d->arena_size = (d->arena_size + 2 * max_stride + 7) & ~7LL;
+	d->arena_slots = d->arena_size / STRIDE(0);
+	d->arena = malloc(d->arena_size);
+	assert(d->arena);
+	d->buffer = create_spsc(d->arena_slots);
+	d->in_flight = create_queue(d->arena_slots);
+	d->leaving = create_pqueue(2 * d->arena_slots);
+	d->active = create_queue(MAX_FLOWS);
+
+	//RED from an eighth of the queue, up to three times that
+	if (d->red_min <= 0)
+		d->red_min = d->queue_limit / 8;
+	if (d->red_max <= d->red_min)
+		d->red_max = 3 * d->red_min;
+	d->tokens = d->burst;
+}
+
+//xorshift64*, a generator for each thread
+double uniform(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return ((x * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
 
-	if (bind(s2, (struct sockaddr *)&local_addr2, sizeof(local_addr2)) ==
-	    -1) {
-		perror("Failed to bind s2");
-		exit(1);
+int chance(unsigned long long *state, double percent)
+{
+	return uniform(state) * 100 < percent;
+}
+
+//lose the packet? The link first may go from good to bad or back
+int lost(direction * d)
+{
+	if (chance(&d->rng, d->bad ? d->to_good : d->to_bad))
+		d->bad = !d->bad;
+
+	return chance(&d->rng, d->bad ? d->bad_loss : d->loss);
+}
+
+//flip bits in the payload: one in corrupt percent of packets, and
+//every bit with a chance of ber, so longer packets take more errors
+void corrupt_packet(direction * d, packet * p)
+{
+	int len = p->size - offsetof(msg, payload);
+	int mlen = p->m.len & ~ECN_ECHO;
+	if (mlen > 0 && mlen < len)
+		len = mlen;
+	if (len <= 0)
+		return;
+
+	if (chance(&d->rng, d->corrupt))
+		//flip a random bit in a randomly chosen byte of the payload
+		p->m.payload[(int)(uniform(&d->rng) * len)] ^=
+		    1 << (int)(uniform(&d->rng) * 8);
+
+	if (d->ber > 0) {
+		//the bits to the next error are geometric, skip them
+		double per_bit = log1p(-d->ber);
+		double bit = -1;
+		while ((bit += 1 + floor(log(1 - uniform(&d->rng)) / per_bit)) < 8.0 * len)
+			p->m.payload[(long long)bit / 8] ^= 1 << ((long long)bit % 8);
 	}
 }
 
-int send_message1(const msg * m)
+//the jitter of a packet, ns, to add to the delay
+long long jitter(direction * d)
 {
-	if (!link_up1) {
-		printf
-		    ("Trying to send a message but remote peer is not connected on my port %d\n",
-		     LOCAL_PORT1);
+	double u, v;
+
+	if (d->jitter == 0)
+		return 0;
+
+	u = uniform(&d->delay_rng);
+	switch (d->dist) {
+	case DIST_NORMAL:
+		//Box-Muller
+		v = uniform(&d->delay_rng);
+		return d->jitter * sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+	case DIST_PARETO:
+		//shape 3, scaled for a mean of jitter
+		return 2 * d->jitter * (pow(1 - u, -1.0 / 3) - 1);
+	default:
+		return d->jitter * (2 * u - 1);
 	}
-	return sendto(s1, m, sizeof(msg), 0, (struct sockaddr *)&remote_addr1,
-		      sizeof(remote_addr1));
 }
 
-msg *receive_message1()
+//room for the next datagram at the head of the arena, starting at
+//*start, or NULL if the packets still in there leave none
+packet *carve(direction * d, long long *start)
 {
-	msg *ret;
+	long long at = d->carved;
 
- a:
-	ret = (msg *) malloc(sizeof(msg));
+	//a packet does not wrap around the end
+	if (at % d->arena_size + max_stride > d->arena_size)
+		at += d->arena_size - at % d->arena_size;
+	if (at + max_stride - __atomic_load_n(&d->freed, __ATOMIC_ACQUIRE) > d->arena_size)
+		return NULL;
 
-	if (!link_up1) {
-		sz = sizeof(remote_addr1);
-		if (recvfrom
-		    (s1, ret, sizeof(msg), 0, (struct sockaddr *)&remote_addr1,
-		     &sz) == -1) {
-			free(ret);
-			return NULL;
-		}
+	*start = at;
+	return (packet *) (d->arena + at % d->arena_size);
+}
 
-		link_up1 = 1;
+//keep the packet carved at start, it takes only the bytes it got
+void commit(direction * d, packet * p, long long start)
+{
+	p->end = start + STRIDE(p->size);
+	d->carved = p->end;
+}
 
-#if DEBUG
-		printf("Link 1 is up, remote addr is %s port %d\n",
-		       inet_ntoa(remote_addr1.sin_addr),
-		       ntohs(remote_addr1.sin_port));
-#endif
+unsigned long long now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
 
-		free(ret);
-		goto a;
-	} else if (recvfrom(s1, ret, sizeof(msg), 0, NULL, NULL) == -1) {
-		free(ret);
-		return NULL;
+static void sleep_until(unsigned long long deadline)
+{
+	struct timespec t;
+	t.tv_sec = deadline / 1000000000ULL;
+	t.tv_nsec = deadline % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL))
+		;
+}
+
+//the time packets are stamped with, real or virtual
+unsigned long long link_time()
+{
+	if (virtual_time)
+		return __atomic_load_n(&virtual_clock, __ATOMIC_ACQUIRE);
+	return now();
+}
+
+//wait until deadline, or until a packet shows up in the buffer of d
+//if on_arrival. The sleep is aimed sleep_slack early and the rest spun.
+void wait_until(direction * d, unsigned long long deadline, int on_arrival)
+{
+	spsc_queue *buffer = d->buffer;
+	long long left = deadline - now();
+
+	if (left > SPIN_LIMIT + sleep_slack) {
+		if (on_arrival)
+			spsc_wait_until(buffer, deadline - sleep_slack);
+		else
+			sleep_until(deadline - sleep_slack);
 	}
-	return ret;
+
+	while (now() < deadline && !(on_arrival && spsc_size(buffer) > 0))
+		cpu_relax();
 }
 
-int send_message2(const msg * m)
+//how late the sleeps wake up: the worst of a few short ones
+void calibrate()
 {
-	if (!link_up2) {
-		printf
-		    ("Trying to send a message but remote peer is not connected on my port %d\n",
-		     LOCAL_PORT2);
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		unsigned long long deadline = now() + 100000;
+		sleep_until(deadline);
+		long long late = now() - deadline;
+		if (late > sleep_slack)
+			sleep_slack = late;
 	}
-	return sendto(s2, m, sizeof(msg), 0, (struct sockaddr *)&remote_addr2,
-		      sizeof(remote_addr2));
+
+#if DEBUG
+	printf("Sleeps wake up to %lld ns late\n", sleep_slack);
+#endif
 }
 
-msg *receive_message2()
+//send every packet that is through at time t, however many, and free
+//what is done with. Returns the number of packets sent.
+int release(direction * d, unsigned long long t)
 {
-	msg *ret;
+	packet *p;
+	int sent = 0;
 
- a:
-	ret = (msg *) malloc(sizeof(msg));
-	if (!link_up2) {
-		sz = sizeof(remote_addr2);
-		if (recvfrom
-		    (s2, ret, sizeof(msg), 0, (struct sockaddr *)&remote_addr2,
-		     &sz) == -1) {
-			free(ret);
-			return NULL;
-		}
-		link_up2 = 1;
+	while (d->leaving->size > 0 && pq_min(d->leaving) <= t) {
+		p = (packet *) pq_pop(d->leaving);
+		if (send_packet(d, p) < 0)
+			perror("SNDMSG");
+		p->copies--;
+		sent++;
+
+		d->delivered++;
+		d->delivered_bytes += p->size;
+		d->total_latency += t - p->arrival;
+		flows[p->flow].lanes[d->side].delivered_bytes += p->size;
 
 #if DEBUG
-		printf("Link 2 is up, remote addr is %s port %d\n",
-		       inet_ntoa(remote_addr2.sin_addr),
-		       ntohs(remote_addr2.sin_port));
+		printf("Sending message\n");
 #endif
+	}
+	while (d->in_flight->size > 0 && ((packet *) queue_peek(d->in_flight))->copies == 0) {
+		p = (packet *) dequeue(d->in_flight);
+		__atomic_store_n(&d->freed, p->end, __ATOMIC_RELEASE);
+	}
 
-		free(ret);
-		goto a;
-	} else if (recvfrom(s2, ret, sizeof(msg), 0, NULL, NULL) == -1) {
-		free(ret);
-		return NULL;
+	return sent;
+}
+
+static packet *take_head(direction * d, lane * l)
+{
+	packet *p = l->head;
+
+	l->head = p->next;
+	if (l->head == NULL)
+		l->tail = NULL;
+	l->packets--;
+	l->bytes -= p->size;
+	d->backlog--;
+	d->backlog_bytes -= p->size;
+
+	__atomic_sub_fetch(&l->admitted, p->size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&l->admitted_packets, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&d->admitted, p->size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&d->admitted_packets, 1, __ATOMIC_RELAXED);
+
+	return p;
+}
+
+//one more packet the link does not carry
+static void count_drop(direction * d)
+{
+	printf("Dropped %spacket\n", d->name);
+	__atomic_add_fetch(&d->dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void drop(direction * d, packet * p)
+{
+	//nothing more to send, freed in its turn
+	p->copies = 0;
+	count_drop(d);
+}
+
+static void mark(direction * d, packet * p)
+{
+	p->ce = 1;
+	__atomic_add_fetch(&d->marked, 1, __ATOMIC_RELAXED);
+}
+
+static int over_limit(direction * d, long long bytes, int packets)
+{
+	return bytes > d->queue_limit
+	    || (d->queue_packets > 0 && packets > d->queue_packets);
+}
+
+//token bucket: whether p comes faster than the policer lets through
+static int policed(direction * d, packet * p)
+{
+	if (d->police_rate == 0)
+		return 0;
+
+	if (p->arrival > d->tokens_time)
+		d->tokens += (p->arrival - d->tokens_time) * d->police_rate;
+	d->tokens_time = p->arrival;
+	if (d->tokens > d->burst)
+		d->tokens = d->burst;
+	if (d->tokens < p->size)
+		return 1;
+
+	d->tokens -= p->size;
+	return 0;
+}
+
+#define RED_WEIGHT 0.002
+
+//RED: whether p, coming to a queue of this many bytes, is to be marked
+//or dropped early. Over red_max every packet is.
+static int red(direction * d, red_state * r, long long bytes, packet * p)
+{
+	double pb;
+
+	if (bytes > 0)
+		r->avg += RED_WEIGHT * (bytes - r->avg);
+	else if (p->arrival > r->last)
+		//the average goes down while the queue is empty, as if
+		//full datagrams kept coming to find it so
+		r->avg *= pow(1 - RED_WEIGHT, (p->arrival - r->last) / (QUANTUM * d->byte_time));
+	r->last = p->arrival;
+
+	if (r->avg < d->red_min) {
+		r->count = 0;
+		return 0;
+	}
+	if (r->avg >= d->red_max) {
+		r->count = 0;
+		return 1;
 	}
 
-	return ret;
+	//spread evenly between the packets rather than in bunches
+	r->count++;
+	pb = d->red_max_p / 100 * (r->avg - d->red_min) / (d->red_max - d->red_min);
+	if (r->count * pb < 1 && uniform(&d->rng) * (1 - r->count * pb) >= pb)
+		return 0;
+	r->count = 0;
+	return 1;
 }
 
-unsigned long long now()
+//let p in the queue of its link, or drop it. Called by run_forwarding,
+//before p takes room in the arena. The policer and RED have their say
+//first. A separate link has a queue of its own. A full shared queue
+//drops what comes from flows that have their fair share in it, the
+//others get in and the scheduler makes room.
+int admit(direction * d, packet * p)
 {
-	struct timeval b;
-	gettimeofday(&b, NULL);
-	return (unsigned long long)b.tv_sec * 1000000 + b.tv_usec;
+	lane *l = &flows[p->flow].lanes[d->side];
+	long long mine = __atomic_load_n(&l->admitted, __ATOMIC_RELAXED) + p->size;
+	int my_packets = __atomic_load_n(&l->admitted_packets, __ATOMIC_RELAXED) + 1;
+	long long all = __atomic_load_n(&d->admitted, __ATOMIC_RELAXED) + p->size;
+	int i, n, busy = 1, early = 0;
+
+	if (policed(d, p))
+		return 0;
+	if (d->aqm == AQM_RED) {
+		early = red(d, separate ? &l->red : &d->red, (separate ? mine : all) - p->size, p);
+		if (early && !d->ecn)
+			return 0;
+	}
+
+	if (separate) {
+		if (over_limit(d, mine, my_packets))
+			return 0;
+	} else if (over_limit(d, all, __atomic_load_n(&d->admitted_packets, __ATOMIC_RELAXED) + 1)) {
+		n = __atomic_load_n(&nflows, __ATOMIC_ACQUIRE);
+		for (i = 0; i < n; i++)
+			if (&flows[i].lanes[d->side] != l
+			    && __atomic_load_n(&flows[i].lanes[d->side].admitted_packets, __ATOMIC_RELAXED))
+				busy++;
+		if (over_limit(d, mine * busy, my_packets * busy))
+			return 0;
+	}
+
+	__atomic_add_fetch(&l->admitted, p->size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&l->admitted_packets, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&d->admitted, p->size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&d->admitted_packets, 1, __ATOMIC_RELAXED);
+	p->ce = p->ecn == IPTOS_ECN_CE;
+	if (early)
+		mark(d, p);
+	return 1;
 }
 
-void *link_scheduler(void *argument)
+//the lane with the most bytes waiting on a shared link
+static lane *fattest(direction * d)
 {
-	msg_in_flight *mif;
-	queue *in_flight = create_queue();
-	long long idle_time = 0;
-	long long crt_time, wait_time_idle, wait_time_send;
-	int stuff;
+	lane *l, *most = NULL;
+	int i;
 
-	while (1) {
-		crt_time = now();
+	for (i = 0; i < d->active->size; i++) {
+		l = d->active->items[(d->active->head + i) % d->active->capacity];
+		if (most == NULL || l->bytes > most->bytes)
+			most = l;
+	}
 
-#if DEBUG
-		printf("In flight size %d at %lld\n", in_flight->size,
-		       crt_time);
-#endif
+	return most;
+}
+
+//move what came in from buffer to the lanes of its flows. A shared
+//queue over its limit then drops the oldest packets of the flows with
+//the most bytes in it.
+void take_arrivals(direction * d)
+{
+	packet *p;
+	lane *l;
+
+	while ((p = (packet *) spsc_pop(d->buffer)) != NULL) {
+		l = &flows[p->flow].lanes[d->side];
+		enqueue(d->in_flight, p);
+
+		//one that finds its link idle starts when it came
+		if (separate ? l->packets == 0 : d->backlog == 0) {
+			unsigned long long *idle = separate ? &l->idle_time : &d->idle_time;
+			if (*idle < p->arrival)
+				*idle = p->arrival;
+		}
+
+		p->next = NULL;
+		if (l->tail)
+			l->tail->next = p;
+		else
+			l->head = p;
+		l->tail = p;
+		l->packets++;
+		l->bytes += p->size;
+		d->backlog++;
+		d->backlog_bytes += p->size;
+
+		if (!separate && !l->active) {
+			l->active = 1;
+			l->deficit = QUANTUM;
+			enqueue(d->active, l);
+		}
 
-		while (in_flight->size > 0) {
-			msg_in_flight *last =
-			    (msg_in_flight *) in_flight->last->crt;
-			if (crt_time < last->finish_time) {
+		while (!separate && over_limit(d, d->backlog_bytes, d->backlog))
+			drop(d, take_head(d, fattest(d)));
+	}
+}
+
+//CoDel: whether p, leaving a queue of this many bytes at t, waited
+//longer than target for an interval by now
+static int too_long(direction * d, codel_state * c, packet * p, long long bytes,
+		    unsigned long long t)
+{
+	if ((long long)(t - p->arrival) < d->target || bytes <= QUANTUM) {
+		c->first_above = 0;
+		return 0;
+	}
+	if (c->first_above == 0) {
+		c->first_above = t + d->interval;
+		return 0;
+	}
+	return t >= c->first_above;
+}
+
+//when CoDel drops next, sooner the more it dropped already
+static unsigned long long control_law(direction * d, unsigned long long t, int count)
+{
+	return t + d->interval / sqrt(count);
+}
+
+//the next packet of lane l to go on the link at t, or NULL if the
+//queue had only packets it drops. CoDel, as in RFC 8289, keeps one
+//state for the queue of every link.
+packet *next_packet(direction * d, lane * l, unsigned long long t)
+{
+	codel_state *c = separate ? &l->codel : &d->codel;
+	long long *bytes = separate ? &l->bytes : &d->backlog_bytes;
+	packet *p = take_head(d, l);
+	int delta, ok;
+
+	if (d->aqm != AQM_CODEL)
+		return p;
+
+	ok = too_long(d, c, p, *bytes, t);
+	if (c->dropping) {
+		if (!ok)
+			c->dropping = 0;
+		while (c->dropping && t >= c->drop_next) {
+			c->count++;
+			c->drop_next = control_law(d, c->drop_next, c->count);
+			if (d->ecn) {
+				mark(d, p);
 				break;
 			}
-			//else send first packet on the wire
-			mif = (msg_in_flight *) dequeue(in_flight);
-			if (!mif) {
-				printf
-				    ("Error in deque: expecting non null msg!\n");
-				exit(1);
-			}
-			if (send_message2(mif->m) <= 0)
-				perror("SNDMSG2");
+			drop(d, p);
+			if (l->head == NULL)
+				return NULL;
+			p = take_head(d, l);
+			if (!too_long(d, c, p, *bytes, t))
+				c->dropping = 0;
+		}
+	} else if (ok && ((long long)(t - c->drop_next) < d->interval
+			  || t - c->first_above >= d->interval)) {
+		//dropping again soon after the last time, as fast as then
+		delta = c->count - c->lastcount;
+		c->dropping = 1;
+		c->count = delta > 1
+		    && (long long)(t - c->drop_next) < 16 * d->interval ? delta : 1;
+		c->drop_next = control_law(d, t, c->count);
+		c->lastcount = c->count;
+		if (d->ecn)
+			mark(d, p);
+		else {
+			drop(d, p);
+			if (l->head == NULL)
+				return NULL;
+			p = take_head(d, l);
+		}
+	}
 
-#if DEBUG
-			printf("Sending message\n");
-#endif
+	return p;
+}
 
-			free(mif->m);
-			free(mif);
-			mif = NULL;
-		}
+//put p of lane l on the wire, the link being free from *idle on
+void put_on_link(direction * d, lane * l, packet * p, unsigned long long *idle)
+{
+	unsigned long long finish;
+	int i;
 
-		pthread_mutex_lock(&buffer_lock);
-		stuff = buffer->size > 0;
-		pthread_mutex_unlock(&buffer_lock);
+	//as long as its bytes take at the link's speed
+	*idle += (long long)(p->size * d->byte_time + 0.5);
+
+	//every copy is delayed on its own. Unless reordered it does not
+	//leave before the ones of its flow that came earlier.
+	for (i = 0; i < p->copies; i++) {
+		long long late = d->delay + jitter(d);
+		finish = *idle + (late > 0 ? late : 0);
+		if (!chance(&d->delay_rng, d->reorder)) {
+			if (finish < l->last_finish)
+				finish = l->last_finish;
+			l->last_finish = finish;
+		}
+		pq_push(d->leaving, finish, p);
+	}
 
 #if DEBUG
-		printf("Stuff is %d\n", stuff);
+	printf("Enquing message\n");
 #endif
+}
 
-		wait_time_send = wait_time_idle = 0;
-
-		//crt_time = now();
+//put on the wire everything the links had time for by t. Back to back
+//packets start when the one before is done, even if we woke up late.
+void launch(direction * d, unsigned long long t)
+{
+	packet *p;
+	lane *l;
+	int i, n;
+
+	take_arrivals(d);
+
+	if (separate) {
+		n = __atomic_load_n(&nflows, __ATOMIC_ACQUIRE);
+		for (i = 0; i < n; i++) {
+			l = &flows[i].lanes[d->side];
+			while (l->head && l->idle_time <= t)
+				if ((p = next_packet(d, l, l->idle_time)) != NULL)
+					put_on_link(d, l, p, &l->idle_time);
+		}
+		return;
+	}
 
-		//now see if we can put stuff in flight
-		if (stuff && crt_time >= idle_time) {
-			idle_time = crt_time + serialization_delay;
+	//deficit round robin: a flow sends while the bytes of its turn
+	//last, then the next one has its turn
+	while (d->backlog && d->idle_time <= t) {
+		l = (lane *) queue_peek(d->active);
+		if (l->head == NULL) {
+			//emptied by drops
+			l->active = 0;
+			dequeue(d->active);
+		} else if (l->deficit < l->head->size) {
+			l->deficit += QUANTUM;
+			enqueue(d->active, dequeue(d->active));
+		} else {
+			if ((p = next_packet(d, l, d->idle_time)) != NULL) {
+				l->deficit -= p->size;
+				put_on_link(d, l, p, &d->idle_time);
+			}
+			if (l->head == NULL) {
+				l->active = 0;
+				dequeue(d->active);
+			}
+		}
+	}
+}
 
-			mif = (msg_in_flight *) malloc(sizeof(msg_in_flight));
-			assert(mif);
+//when there is something to do next, NO_EVENT if only an arrival
+//would make some
+unsigned long long next_event(direction * d)
+{
+	unsigned long long next = NO_EVENT;
+	lane *l;
+	int i, n;
+
+	if (d->leaving->size > 0)
+		next = pq_min(d->leaving);
+	if (separate) {
+		n = __atomic_load_n(&nflows, __ATOMIC_ACQUIRE);
+		for (i = 0; i < n; i++) {
+			l = &flows[i].lanes[d->side];
+			if (l->head && l->idle_time < next)
+				next = l->idle_time;
+		}
+	} else if (d->backlog && d->idle_time < next)
+		next = d->idle_time;
 
-			pthread_mutex_lock(&buffer_lock);
-			mif->m = (msg *) dequeue(buffer);
-			pthread_mutex_unlock(&buffer_lock);
+	return next;
+}
 
-			assert(mif->m);
-			mif->finish_time =
-			    crt_time + serialization_delay + delay;
+void *link_scheduler(void *argument)
+{
+	direction *d = argument;
+	unsigned long long crt_time;
 
-			//send message here from buffer to link
-			enqueue(in_flight, mif);
+	while (1) {
+		crt_time = now();
 
 #if DEBUG
-			printf("Enquing message\n");
+		printf("In flight size %d at %llu\n", d->in_flight->size,
+		       crt_time);
 #endif
-		}
-		wait_time_idle = idle_time - crt_time;
 
-		if (in_flight->size > 0) {
-			msg_in_flight *last =
-			    (msg_in_flight *) in_flight->last->crt;
-			wait_time_send = last->finish_time - crt_time;
-		}
+		release(d, crt_time);
+		launch(d, crt_time);
 
-		if (wait_time_idle > 0 || wait_time_send > 0) {
-			long long wait_time = 0;
-			if (wait_time_idle > 0)
-				wait_time = wait_time_idle;
-			if (wait_time_send > 0 && wait_time_send < wait_time)
-				wait_time = wait_time_send;
-
-			//printf("Sleeping %lld\n", wait_time);
-			usleep(wait_time);
+		//sleep until the next thing to do. Separate links wake up
+		//for packets that find theirs idle.
+		if (d->backlog) {
+			wait_until(d, next_event(d), separate);
+		} else if (d->leaving->size > 0) {
+			//a packet may come in meanwhile and find the link idle
+			wait_until(d, next_event(d), 1);
 		} else {
-			pthread_mutex_lock(&buffer_lock);
-			assert(!buffer->size);
 #if DEBUG
-			printf("Waiting on cond\n");
+			printf("Waiting for packets\n");
 #endif
-			pthread_cond_wait(&buffer_cond, &buffer_lock);
-			pthread_mutex_unlock(&buffer_lock);
+			spsc_wait(d->buffer);
 		}
 	}
 
 	return NULL;
 }
 
-void *run_forwarding(void *param)
+long long received()
 {
-	msg *m;
+	return __atomic_load_n(&forward.received, __ATOMIC_ACQUIRE) +
+	    __atomic_load_n(&reverse.received, __ATOMIC_ACQUIRE);
+}
 
-	while (1) {
-		int overflow;
-		m = receive_message1();
-		if (m == NULL) {
-			perror("Read error");
-			exit(1);
-		}
-		//check queue space
-		pthread_mutex_lock(&buffer_lock);
-		overflow = buffer->size >= BUFFER_SIZE;
-		pthread_mutex_unlock(&buffer_lock);
+void report(direction * d, unsigned long long t)
+{
+	printf("%s%lld packets, %.3f Mb/s, mean latency %.3f ms, %lld dropped, %lld marked\n",
+	       d == &forward ? "forward: " : "reverse: ", d->delivered,
+	       t ? d->delivered_bytes * 8000.0 / t : 0,
+	       d->delivered ? d->total_latency / 1e6 / d->delivered : 0,
+	       d->dropped, d->marked);
+}
 
-		if (overflow || (rand() % 100) < loss) {
-			//just drop message
-			free(m);
-			printf("Dropped packet\n");
-		} else {
-			if (rand() % 100 < corrupt) {
-				//flip a random bit in a randomly chosen byte of the payload
-				m->payload[rand() % m->len] ^=
-				    1 << (rand() % 8);
-			}
-			//printf("Enqueue 1.");
-			pthread_mutex_lock(&buffer_lock);
-			enqueue(buffer, m);
-			pthread_cond_signal(&buffer_cond);
-			pthread_mutex_unlock(&buffer_lock);
-			//printf("Done!\n");
+//both directions on one virtual clock, until stopped. Every packet
+//that leaves the link is expected to be answered by its endpoint:
+//the clock stands still until as many datagrams came in, or none did
+//for settle, then jumps to the next thing to do. For endpoints that
+//answer every datagram with at most one, as stop and wait does, the
+//run is the same every time for the same seed.
+void run_virtual()
+{
+	unsigned long long t = 0, next;
+	long long seen = received(), answers = 0, got;
+	unsigned long long deadline;
+	int i;
+
+	while (!stop) {
+		answers += release(&forward, t) + release(&reverse, t);
+		launch(&forward, t);
+		launch(&reverse, t);
+
+		//let the endpoints answer what they got
+		deadline = now() + settle;
+		while (answers > 0 && received() == seen && now() < deadline)
+			cpu_relax();
+		got = received() - seen;
+		seen += got;
+		answers = got && got < answers ? answers - got : 0;
+		if (got)
+			continue;
+
+		next = next_event(&forward);
+		if (next_event(&reverse) < next)
+			next = next_event(&reverse);
+		if (next == NO_EVENT) {
+			//nothing to do until a packet comes, whenever it does
+			while (received() == seen && !stop)
+				spsc_wait_until(forward.buffer, now() + 1000000);
+			continue;
 		}
+
+		t = next;
+		__atomic_store_n(&virtual_clock, t, __ATOMIC_RELEASE);
 	}
+
+	printf("Simulated %.6f s\n", t / 1e9);
+	report(&forward, t);
+	report(&reverse, t);
+	for (i = 0; nflows > 1 && i < nflows; i++)
+		printf("flow %d on ports %d/%d: %.3f Mb/s forward, %.3f Mb/s reverse\n",
+		       i, LOCAL_PORT1 + 2 * flows[i].pair,
+		       LOCAL_PORT2 + 2 * flows[i].pair,
+		       t ? flows[i].lanes[0].delivered_bytes * 8000.0 / t : 0,
+		       t ? flows[i].lanes[1].delivered_bytes * 8000.0 / t : 0);
 }
 
-void *run_reverse_forwarding(void *param)
+void *run_forwarding(void *param)
 {
-	msg *m;
+	direction *d = param;
+	packet *p = NULL;
+	long long start;
+	//where datagrams go when the arena is full, to be dropped
+	packet *spare = malloc(offsetof(packet, m) + mtu);
 
 	while (1) {
-		m = receive_message2();
-		if (m == NULL) {
+		//a packet that was dropped is reused for the next datagram
+		if (p == NULL)
+			p = carve(d, &start);
+		if (receive_packet(d->side, &d->next_pair, p ? p : spare) < 0) {
 			perror("Read error");
 			exit(1);
 		}
+		if (p)
+			p->arrival = link_time();
 
-		send_message1(m);
-		free(m);
+		if (p == NULL || lost(d)) {
+			//just drop message
+			count_drop(d);
+		} else {
+			corrupt_packet(d, p);
+			p->copies = chance(&d->rng, d->dup) ? 2 : 1;
+			//a full queue drops it
+			if (!admit(d, p)) {
+				count_drop(d);
+			} else {
+				commit(d, p, start);
+				//never full, it has a slot for every packet
+				//the arena holds
+				spsc_push(d->buffer, p);
+				p = NULL;
+			}
+		}
+
+		//counted once it is in buffer, for run_virtual
+		__atomic_add_fetch(&d->received, 1, __ATOMIC_RELEASE);
 	}
 }
 
@@ -337,6 +1005,106 @@ void *run_reverse_forwarding(void *param)
 #define DELAY 2
 #define LOSS 3
 #define CORRUPT 4
+#define MTU 5
+#define QLIMIT 6
+#define PACKETS 7
+#define TO_BAD 8
+#define TO_GOOD 9
+#define BAD_LOSS 10
+#define BER 11
+#define JITTER 12
+#define DIST 13
+#define REORDER 14
+#define DUP 15
+#define VIRTUAL 16
+#define SEED 17
+#define SETTLE 18
+#define PAIRS 19
+#define BOTTLENECK 20
+#define AQM 21
+#define ECN 22
+#define POLICE 23
+#define BURST 24
+#define TARGET 25
+#define INTERVAL 26
+#define RED_MIN 27
+#define RED_MAX 28
+#define MAX_P 29
+#define SYMMETRIC 30
+//added to the type of a parameter for the way back
+#define REVERSE 32
+
+//parameters of the whole link rather than of one direction
+int link_wide(int type)
+{
+	return type == MTU || type == VIRTUAL || type == SEED || type == SETTLE
+	    || type == PAIRS || type == BOTTLENECK || type == SYMMETRIC;
+}
+
+int param_type(const char *name)
+{
+	if (!strcasecmp(name, "speed"))
+		return SPEED;
+	else if (!strcasecmp(name, "delay"))
+		return DELAY;
+	else if (!strcasecmp(name, "loss"))
+		return LOSS;
+	else if (!strcasecmp(name, "corrupt"))
+		return CORRUPT;
+	else if (!strcasecmp(name, "mtu"))
+		return MTU;
+	else if (!strcasecmp(name, "queue"))
+		return QLIMIT;
+	else if (!strcasecmp(name, "packets"))
+		return PACKETS;
+	else if (!strcasecmp(name, "gb"))
+		return TO_BAD;
+	else if (!strcasecmp(name, "bg"))
+		return TO_GOOD;
+	else if (!strcasecmp(name, "bloss"))
+		return BAD_LOSS;
+	else if (!strcasecmp(name, "ber"))
+		return BER;
+	else if (!strcasecmp(name, "jitter"))
+		return JITTER;
+	else if (!strcasecmp(name, "dist"))
+		return DIST;
+	else if (!strcasecmp(name, "reorder"))
+		return REORDER;
+	else if (!strcasecmp(name, "dup"))
+		return DUP;
+	else if (!strcasecmp(name, "virtual"))
+		return VIRTUAL;
+	else if (!strcasecmp(name, "seed"))
+		return SEED;
+	else if (!strcasecmp(name, "settle"))
+		return SETTLE;
+	else if (!strcasecmp(name, "pairs"))
+		return PAIRS;
+	else if (!strcasecmp(name, "bottleneck"))
+		return BOTTLENECK;
+	else if (!strcasecmp(name, "aqm"))
+		return AQM;
+	else if (!strcasecmp(name, "ecn"))
+		return ECN;
+	else if (!strcasecmp(name, "police"))
+		return POLICE;
+	else if (!strcasecmp(name, "burst"))
+		return BURST;
+	else if (!strcasecmp(name, "target"))
+		return TARGET;
+	else if (!strcasecmp(name, "interval"))
+		return INTERVAL;
+	else if (!strcasecmp(name, "redmin"))
+		return RED_MIN;
+	else if (!strcasecmp(name, "redmax"))
+		return RED_MAX;
+	else if (!strcasecmp(name, "maxp"))
+		return MAX_P;
+	else if (!strcasecmp(name, "symmetric"))
+		return SYMMETRIC;
+	return -1;
+}
 
 int split_param(char *p, int *type, double *value)
 {
@@ -349,99 +1117,294 @@ int split_param(char *p, int *type, double *value)
 			c[crt] = 0;
 			crt = 0;
 
-			if (!strcasecmp(c, "speed"))
-				*type = SPEED;
-			else if (!strcasecmp(c, "delay"))
-				*type = DELAY;
-			else if (!strcasecmp(c, "loss"))
-				*type = LOSS;
-			else if (!strcasecmp(c, "corrupt"))
-				*type = CORRUPT;
-			else {
+			//rdelay= is the delay= of the reverse direction
+			*type = param_type(c);
+			if (*type < 0 && (c[0] == 'r' || c[0] == 'R')
+			    && param_type(c + 1) > 0 && !link_wide(param_type(c + 1)))
+				*type = param_type(c + 1) | REVERSE;
+			if (*type < 0) {
 				printf("Unknown parameter %s\n", c);
 				return -1;
 			}
-		} else
+		} else if (crt < sizeof(c) - 1)
 			c[crt++] = *p;
 	}
+	c[crt] = 0;
+
+	if (t) {
+		printf("Parameter %s has no value\n", c);
+		return -1;
+	}
+	if ((*type & ~REVERSE) == DIST) {
+		if (!strcasecmp(c, "uniform"))
+			*value = DIST_UNIFORM;
+		else if (!strcasecmp(c, "normal"))
+			*value = DIST_NORMAL;
+		else if (!strcasecmp(c, "pareto"))
+			*value = DIST_PARETO;
+		else {
+			printf("Unknown distribution %s\n", c);
+			return -1;
+		}
+		return 0;
+	}
+	if ((*type & ~REVERSE) == BOTTLENECK) {
+		if (!strcasecmp(c, "shared"))
+			*value = 0;
+		else if (!strcasecmp(c, "separate"))
+			*value = 1;
+		else {
+			printf("Unknown bottleneck %s\n", c);
+			return -1;
+		}
+		return 0;
+	}
+	if ((*type & ~REVERSE) == AQM) {
+		if (!strcasecmp(c, "droptail"))
+			*value = AQM_DROPTAIL;
+		else if (!strcasecmp(c, "red"))
+			*value = AQM_RED;
+		else if (!strcasecmp(c, "codel"))
+			*value = AQM_CODEL;
+		else {
+			printf("Unknown queue management %s\n", c);
+			return -1;
+		}
+		return 0;
+	}
 	*value = atof(c);
 	return 0;
 }
 
-int guess_hz()
+void set_param(direction * d, int type, double value)
 {
-	long long a, b, diff = 0;
-	int i;
-
-	for (i = 0; i < 100; i++) {
-		a = now();
-		//0.1ms
-		usleep(100);
-		b = now();
-		diff += (b - a);
+	switch (type) {
+	case SPEED:
+		printf("Setting %sspeed to %f Mb/s\n", d->name, value);
+		d->byte_time = 8000 / value;
+		break;
+	case DELAY:
+		printf("Setting %sdelay to %f ms\n", d->name, value);
+		d->delay = value * 1000000;
+		break;
+	case LOSS:
+		printf("Setting %sloss rate to %f%%\n", d->name, value);
+		d->loss = value;
+		break;
+	case CORRUPT:
+		printf("Setting %scorruption rate to %f%%\n", d->name, value);
+		d->corrupt = value;
+		break;
+	case MTU:
+		printf("Setting mtu to %d bytes\n", (int)value);
+		mtu = value;
+		if (mtu > sizeof(msg))
+			mtu = sizeof(msg);
+		break;
+	case QLIMIT:
+		printf("Setting %squeue limit to %lld bytes\n", d->name,
+		       (long long)value);
+		d->queue_limit = value;
+		break;
+	case PACKETS:
+		printf("Setting %squeue limit to %d packets\n", d->name,
+		       (int)value);
+		d->queue_packets = value;
+		break;
+	case TO_BAD:
+		printf("Setting %schance of a loss burst to %f%%\n", d->name,
+		       value);
+		d->to_bad = value;
+		break;
+	case TO_GOOD:
+		printf("Setting %schance of a loss burst ending to %f%%\n",
+		       d->name, value);
+		d->to_good = value;
+		break;
+	case BAD_LOSS:
+		printf("Setting %sloss rate in bursts to %f%%\n", d->name,
+		       value);
+		d->bad_loss = value;
+		break;
+	case BER:
+		printf("Setting %sbit error rate to %g\n", d->name, value);
+		d->ber = value < 1 ? value : 1;
+		break;
+	case JITTER:
+		printf("Setting %sjitter to %f ms\n", d->name, value);
+		d->jitter = value * 1000000;
+		break;
+	case DIST:
+		printf("Setting %sjitter distribution to %s\n", d->name,
+		       value == DIST_NORMAL ? "normal" :
+		       value == DIST_PARETO ? "pareto" : "uniform");
+		d->dist = value;
+		break;
+	case REORDER:
+		printf("Setting %sreordering to %f%%\n", d->name, value);
+		d->reorder = value;
+		break;
+	case DUP:
+		printf("Setting %sduplication to %f%%\n", d->name, value);
+		d->dup = value;
+		break;
+	case VIRTUAL:
+		printf("Setting %s time\n", value ? "virtual" : "real");
+		virtual_time = value != 0;
+		break;
+	case SEED:
+		printf("Setting random seed to %llu\n", (unsigned long long)value);
+		seed = value;
+		break;
+	case PAIRS:
+		pairs = value;
+		if (pairs < 1)
+			pairs = 1;
+		if (pairs > MAX_PAIRS)
+			pairs = MAX_PAIRS;
+		printf("Setting %d pairs of ports, %d/%d to %d/%d\n", pairs,
+		       LOCAL_PORT1, LOCAL_PORT2, LOCAL_PORT1 + 2 * (pairs - 1),
+		       LOCAL_PORT2 + 2 * (pairs - 1));
+		break;
+	case BOTTLENECK:
+		printf("Setting %s\n", value ? "a separate link for every flow" :
+		       "one link shared fairly by all flows");
+		separate = value != 0;
+		break;
+	case SYMMETRIC:
+		printf("Setting the way back to %s\n", value ?
+		       "the impairments of the way there" : "no impairments");
+		symmetric = value != 0;
+		break;
+	case SETTLE:
+		printf("Setting time to wait for answers to %f ms\n", value);
+		settle = value * 1000000;
+		break;
+	case AQM:
+		printf("Setting %squeue management to %s\n", d->name,
+		       value == AQM_RED ? "RED" :
+		       value == AQM_CODEL ? "CoDel" : "drop tail");
+		d->aqm = value;
+		break;
+	case ECN:
+		printf("Setting %squeue to %s packets\n", d->name,
+		       value ? "mark" : "drop");
+		d->ecn = value != 0;
+		break;
+	case POLICE:
+		printf("Setting %spolicer to %f Mb/s\n", d->name, value);
+		d->police_rate = value / 8000;
+		break;
+	case BURST:
+		printf("Setting %spolicer burst to %lld bytes\n", d->name,
+		       (long long)value);
+		d->burst = value;
+		break;
+	case TARGET:
+		printf("Setting %sCoDel target to %f ms\n", d->name, value);
+		d->target = value * 1000000;
+		break;
+	case INTERVAL:
+		printf("Setting %sCoDel interval to %f ms\n", d->name, value);
+		d->interval = value * 1000000;
+		break;
+	case RED_MIN:
+		printf("Setting %sRED threshold to %lld bytes\n", d->name,
+		       (long long)value);
+		d->red_min = value;
+		break;
+	case RED_MAX:
+		printf("Setting %sRED maximum to %lld bytes\n", d->name,
+		       (long long)value);
+		d->red_max = value;
+		break;
+	case MAX_P:
+		printf("Setting %sRED drop rate at its maximum to %f%%\n",
+		       d->name, value);
+		d->red_max_p = value;
+		break;
 	}
+}
 
-	int error = (int)(diff / i - 100);
-	printf("Average error  100 was %d\n", error);
-
-	diff = 0;
-	for (i = 0; i < 100; i++) {
-		a = now();
-		//0.1ms
-		usleep(1000);
-		b = now();
-		diff += (b - a);
-	}
+//a way back that only shares the speed, delay and queue of the way there
+void clear_impairments(direction * d)
+{
+	d->loss = 0;
+	d->corrupt = 0;
+	d->ber = 0;
+	d->to_bad = 0;
+	d->jitter = 0;
+	d->reorder = 0;
+	d->dup = 0;
+}
 
-	error = (int)(diff / i - 1000);
-	printf("Average error 1000 was %d\n", error);
-	return error;
+void on_stop(int sig)
+{
+	stop = 1;
 }
 
 int main(int argc, char **argv)
 {
-	pthread_t link_thread, fw_thread;
-	int i;
-	for (i = 1; i < argc; i++) {
-		int type;
-		double value;
-		if (split_param(argv[i], &type, &value) < 0) {
-			printf
-			    ("Usage %s speed=[speed in mb/s] delay=[delay in ms] loss=[percent of packets] corrupt=[percent of packets]\n",
-			     argv[0]);
-			return -1;
+	pthread_t link_thread, fw_thread, reverse_thread;
+	int i, pass;
+
+	//the way back has the speed, delay and queue of the way there (all
+	//of its impairments with symmetric=1), but for the r parameters
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 1; i < argc; i++) {
+			int type;
+			double value;
+			if (split_param(argv[i], &type, &value) < 0) {
+				printf
+				    ("Usage %s speed=[speed in mb/s] delay=[delay in ms] loss=[percent of packets] corrupt=[percent of packets] mtu=[largest datagram in bytes] queue=[queue limit in bytes] packets=[queue limit in packets]\n"
+				     "  gb=[percent chance of a loss burst starting] bg=[percent chance of it ending] bloss=[percent of packets lost in a burst]\n"
+				     "  ber=[bit error rate] jitter=[jitter in ms] dist=[uniform|normal|pareto] reorder=[percent of packets] dup=[percent of packets]\n"
+				     "  virtual=[1 to run on virtual time] settle=[ms to wait for answers in virtual time] seed=[random seed]\n"
+				     "  pairs=[pairs of ports for flows] bottleneck=[shared|separate] symmetric=[1 to impair the way back too]\n"
+				     "  aqm=[droptail|red|codel] ecn=[1 to mark instead of dropping, lib.c echoes marks to the sender] redmin=[bytes] redmax=[bytes] maxp=[percent of packets]\n"
+				     "  target=[CoDel target in ms] interval=[CoDel interval in ms] police=[policer rate in mb/s] burst=[policer burst in bytes]\n"
+				     "Prefixed with r (rspeed=, rdelay=, ...) they apply only to the way back\n",
+				     argv[0]);
+				return -1;
+			}
+
+			if (pass == 0 && !(type & REVERSE))
+				set_param(&forward, type, value);
+			else if (pass == 1 && (type & REVERSE))
+				set_param(&reverse, type & ~REVERSE, value);
 		}
 
-		switch (type) {
-		case SPEED:
-			printf("Setting speed to %f Mb/s\n", value);
-			serialization_delay = 2 * 11200 / value;
-			break;
-		case DELAY:
-			printf("Setting delay %f to ms\n", value);
-			delay = value * 1000;
-			break;
-		case LOSS:
-			printf("Setting loss rate to %f%%\n", value);
-			loss = value;
-			break;
-		case CORRUPT:
-			printf("Setting corruption rate to %f%%\n", value);
-			corrupt = value;
-			break;
+		if (pass == 0) {
+			direction back = forward;
+			back.name = reverse.name;
+			back.side = reverse.side;
+			reverse = back;
+			if (!symmetric)
+				clear_impairments(&reverse);
 		}
 	}
 
-#if DEBUG
-	guess_hz();
-#endif
+	calibrate();
 
 	init_sockets();
-	srand(time(NULL));
-	buffer = create_queue();
-	assert(!pthread_create(&link_thread, NULL, link_scheduler, NULL));
-	assert(!pthread_create(&fw_thread, NULL, run_forwarding, NULL));
+	forward.rng = (seed ? seed : time(NULL)) * 2654435761ULL | 1;
+	forward.delay_rng = forward.rng * 3;
+	reverse.rng = forward.rng * 5;
+	reverse.delay_rng = forward.rng * 7;
+	init_direction(&forward);
+	init_direction(&reverse);
+	assert(!pthread_create(&fw_thread, NULL, run_forwarding, &forward));
+	assert(!pthread_create(&reverse_thread, NULL, run_forwarding, &reverse));
+
+	if (virtual_time) {
+		//report in simulated time when killed
+		signal(SIGINT, on_stop);
+		signal(SIGTERM, on_stop);
+		run_virtual();
+		return 0;
+	}
 
-	run_reverse_forwarding(NULL);
+	assert(!pthread_create(&link_thread, NULL, link_scheduler, &forward));
+	link_scheduler(&reverse);
 	return 0;
 }
@@ -1,11 +1,168 @@
 #ifndef LINK
 #define LINK
 
+#include <netinet/in.h>
+
 #include "lib.h"
+#include "queue.h"
+
+typedef struct packet {
+  int size; //bytes of m that came in the datagram
+  int flow; //index in the flow table
+  int copies; //times it is still to leave the link, 2 if duplicated
+  int ecn; //ECN bits of the IP header it came with
+  int ce; //marked Congestion Experienced, here or before
+  unsigned long long arrival; //when it came in, ns
+  long long end; //where the next packet starts in the arena
+  struct packet *next; //in its lane
+  msg m; //only the first mtu bytes are allocated
+} packet;
+
+//RED: the average bytes in a queue, kept by run_forwarding
+typedef struct {
+  double avg;
+  int count; //packets since the last one marked or dropped
+  unsigned long long last; //when the last packet came
+} red_state;
+
+//CoDel, kept by link_scheduler as packets leave a queue
+typedef struct {
+  //when packets will have waited too long for an interval, 0 while
+  //they do not
+  unsigned long long first_above;
+  int dropping;
+  unsigned long long drop_next;
+  int count, lastcount; //packets dropped in this and the last episode
+} codel_state;
+
+//the packets of one flow waiting for the link in one direction, and
+//how the link serves them. Only link_scheduler touches it, but for
+//the admitted counts.
+typedef struct {
+  //let in by run_forwarding and not put on the link or dropped yet
+  long long admitted;
+  int admitted_packets;
+  red_state red; //of its own link
+
+  packet *head, *tail; //in the order they came
+  int packets;
+  long long bytes;
+  //shared bottleneck: in the round robin, and the bytes it may still
+  //send in its turn
+  int active;
+  long long deficit;
+  //separate links: when its own link is done with what it carries
+  unsigned long long idle_time;
+  unsigned long long last_finish; //when its last packet that keeps its place leaves
+  codel_state codel;
+  long long delivered_bytes; //for the report of the virtual mode
+} lane;
+
+//a client and a server talking through the link on one pair of ports,
+//known by their addresses
+typedef struct {
+  int pair;
+  struct sockaddr_in addr[2]; //of the peer on each side
+  int up[2]; //1 once the peer on that side was seen
+  lane lanes[2]; //by direction
+} flow;
+
+#define MAX_FLOWS 64
 
+//one way through the link, with impairment of its own
 typedef struct {
-  msg* m;
-  unsigned long long finish_time;
-} msg_in_flight;
+  const char *name;
+  //all times are ns of CLOCK_MONOTONIC
+  double byte_time; //time a byte takes on the link
+  long long delay;
+  double loss; //percent of packets
+  double corrupt; //percent of packets, one bit flipped in each
+  double ber; //chance of every payload bit to flip
+  //Gilbert-Elliott burst loss: the link goes from a good state to a
+  //bad one and back with these chances per packet (percent), and
+  //loses bad_loss percent of packets in the bad state, loss in the good
+  double to_bad;
+  double to_good;
+  double bad_loss;
+  //extra delay of every packet, and its distribution
+  long long jitter;
+  int dist;
+  double reorder; //percent of packets that may overtake others
+  double dup; //percent of packets that leave the link twice
+  //bytes the queue in front of the link holds, and optionally at
+  //most this many packets
+  long long queue_limit;
+  int queue_packets;
+  //active queue management: AQM_DROPTAIL drops only what does not
+  //fit, AQM_RED drops or marks packets early as the average queue
+  //grows past red_min bytes, up to red_max_p percent at red_max.
+  //AQM_CODEL when packets waited longer than target for an interval.
+  //With ecn, packets are marked Congestion Experienced instead.
+  int aqm;
+  int ecn;
+  long long red_min, red_max;
+  double red_max_p;
+  long long target, interval;
+  //token bucket in front of the queue, 0 to let everything in:
+  //bytes per ns and the most bytes let in at once
+  double police_rate;
+  long long burst;
+
+  //random numbers of run_forwarding and of link_scheduler
+  unsigned long long rng;
+  unsigned long long delay_rng;
+  int bad; //in the bad state now, moved only by run_forwarding
+  //and its policer's tokens, as of tokens_time
+  double tokens;
+  unsigned long long tokens_time;
+
+  int side; //0 from the port 1 side to the port 2 side, 1 the other way
+  int next_pair; //run_forwarding's turn among the pairs of ports
+
+  //packets that came in, from run_forwarding to link_scheduler
+  spsc_queue *buffer;
+  //all the lanes' admitted counts
+  long long admitted;
+  int admitted_packets;
+  red_state red; //of the shared link
+
+  //the packets live back to back in one ring of bytes allocated at
+  //start. run_forwarding carves them at the head, link_scheduler frees
+  //them at the tail once every copy left the link, in the order they
+  //came. Forwarding allocates nothing and takes no lock.
+  char *arena;
+  long long arena_size;
+  long long carved; //bytes carved so far, moved only by run_forwarding
+  long long freed; //bytes freed so far, moved only by link_scheduler
+  int arena_slots; //most packets the arena can hold
+
+  //datagrams that came in, lost or not, counted by run_forwarding
+  long long received;
+
+  //the rest is link_scheduler's
+  queue *in_flight; //every packet taken from buffer, in the order it came
+  pqueue *leaving; //and each copy on the link by when it leaves
+  queue *active; //lanes with packets, in their turn, shared bottleneck
+  //packets and bytes waiting in the lanes
+  int backlog;
+  long long backlog_bytes;
+  unsigned long long idle_time; //when the shared link is done with what it carries
+  codel_state codel;
+  //what left the link, for the report of the virtual mode
+  long long delivered;
+  long long delivered_bytes;
+  unsigned long long total_latency; //ns from coming in to leaving
+  //by either thread
+  long long dropped;
+  long long marked;
+} direction;
+
+#define DIST_UNIFORM 0 //within jitter either way
+#define DIST_NORMAL 1 //with jitter as standard deviation
+#define DIST_PARETO 2 //heavy tailed, only later, jitter on average
+
+#define AQM_DROPTAIL 0
+#define AQM_RED 1
+#define AQM_CODEL 2
 
 #endif
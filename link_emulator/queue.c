@@ -1,63 +1,236 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "queue.h"
 
-void enqueue(queue * q, void *m)
+int enqueue(queue * q, void *m)
 {
-	if (q->first == NULL) {
-		assert(q->last == NULL);
-
-		q->first = (queue_entry *) malloc(sizeof(queue_entry));
-		q->last = q->first;
-	} else {
-		queue_entry *t = (queue_entry *) malloc(sizeof(queue_entry));
-		q->first->prev = t;
-		q->first = t;
-	}
-
-	q->first->prev = NULL;
-	q->first->crt = m;
+	if (q->size == q->capacity)
+		return -1;
 
+	q->items[(q->head + q->size) % q->capacity] = m;
 	q->size++;
+
+	return 0;
 }
 
 void *dequeue(queue * q)
 {
-	queue_entry *t;
 	void *m;
 
-	if (q->first == NULL) {
-		assert(q->size == 0);
+	if (q->size == 0)
 		return NULL;
-	} else if (q->first == q->last) {
-		t = q->last;
-		assert(q->first->prev == NULL);
-
-		q->first = q->last = NULL;
-	} else {
-		t = q->last;
-		q->last = q->last->prev;
-	}
 
-	m = t->crt;
-	free(t);
+	m = q->items[q->head];
+	q->head = (q->head + 1) % q->capacity;
 	q->size--;
 
 	return m;
 }
 
-queue *create_queue()
+void *queue_peek(queue * q)
+{
+	if (q->size == 0)
+		return NULL;
+
+	return q->items[q->head];
+}
+
+queue *create_queue(int capacity)
 {
 	queue *q = (queue *) malloc(sizeof(queue));
-	q->first = NULL;
-	q->last = NULL;
+	assert(q && capacity > 0);
+	q->items = (void **)malloc(capacity * sizeof(void *));
+	assert(q->items);
+	q->capacity = capacity;
+	q->head = 0;
 	q->size = 0;
 	return q;
 }
 
 void destroy_queue(queue * q)
 {
-	assert(0);
+	free(q->items);
+	free(q);
+}
+
+static int pq_less(const pq_entry * a, const pq_entry * b)
+{
+	return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+int pq_push(pqueue * q, unsigned long long key, void *m)
+{
+	pq_entry e = { key, q->seq++, m };
+	int i = q->size;
+
+	if (q->size == q->capacity)
+		return -1;
+
+	//sift up: parents bigger than it move down
+	while (i > 0 && pq_less(&e, &q->entries[(i - 1) / 2])) {
+		q->entries[i] = q->entries[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	q->entries[i] = e;
+	q->size++;
+
+	return 0;
+}
+
+void *pq_pop(pqueue * q)
+{
+	void *m;
+	pq_entry last;
+	int i = 0, child;
+
+	if (q->size == 0)
+		return NULL;
+
+	m = q->entries[0].item;
+	last = q->entries[--q->size];
+
+	//sift down the last entry from the root
+	while ((child = 2 * i + 1) < q->size) {
+		if (child + 1 < q->size
+		    && pq_less(&q->entries[child + 1], &q->entries[child]))
+			child++;
+		if (!pq_less(&q->entries[child], &last))
+			break;
+		q->entries[i] = q->entries[child];
+		i = child;
+	}
+	q->entries[i] = last;
+
+	return m;
+}
+
+unsigned long long pq_min(pqueue * q)
+{
+	assert(q->size > 0);
+	return q->entries[0].key;
+}
+
+pqueue *create_pqueue(int capacity)
+{
+	pqueue *q = (pqueue *) malloc(sizeof(pqueue));
+	assert(q && capacity > 0);
+	q->entries = (pq_entry *) malloc(capacity * sizeof(pq_entry));
+	assert(q->entries);
+	q->capacity = capacity;
+	q->size = 0;
+	q->seq = 0;
+	return q;
+}
+
+int spsc_push(spsc_queue * q, void *m)
+{
+	unsigned head = q->head;
+
+	if (head - q->cached_tail >= q->capacity) {
+		q->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (head - q->cached_tail >= q->capacity)
+			return -1;
+	}
+
+	q->items[head & q->mask] = m;
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&q->idle, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &q->head, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+			NULL, 0);
+
+	return 0;
+}
+
+void *spsc_pop(spsc_queue * q)
+{
+	unsigned tail = q->tail;
+	void *m;
+
+	if (tail == q->cached_head) {
+		q->cached_head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (tail == q->cached_head)
+			return NULL;
+	}
+
+	m = q->items[tail & q->mask];
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return m;
+}
+
+int spsc_size(spsc_queue * q)
+{
+	q->cached_head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	return q->cached_head - q->tail;
+}
+
+//sleep until an entry comes or, if timeout is not NULL, until that
+//absolute CLOCK_MONOTONIC time. 0 once the time passed.
+static int wait_entry(spsc_queue * q, const struct timespec *timeout)
+{
+	unsigned head;
+	int res;
+
+	while ((head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST)) == q->tail) {
+		//announce the sleep, then look again: a push after the look
+		//sees idle, one before it moves head and the futex returns
+		__atomic_store_n(&q->idle, 1, __ATOMIC_SEQ_CST);
+		res = 0;
+		if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == head)
+			res = syscall(SYS_futex, &q->head,
+				      FUTEX_WAIT_BITSET_PRIVATE, head, timeout,
+				      NULL, FUTEX_BITSET_MATCH_ANY);
+		__atomic_store_n(&q->idle, 0, __ATOMIC_SEQ_CST);
+		if (res < 0 && errno == ETIMEDOUT)
+			return 0;
+	}
+
+	return 1;
+}
+
+void spsc_wait(spsc_queue * q)
+{
+	wait_entry(q, NULL);
+}
+
+void spsc_wait_until(spsc_queue * q, unsigned long long deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	wait_entry(q, &ts);
+}
+
+spsc_queue *create_spsc(int capacity)
+{
+	spsc_queue *q;
+	unsigned slots = 1;
+
+	assert(capacity > 0);
+	while (slots < capacity)
+		slots *= 2;
+
+	//outside the assert, which NDEBUG would take away with the call
+	if (posix_memalign((void **)&q, CACHE_LINE, sizeof(spsc_queue)))
+		q = NULL;
+	assert(q);
+	q->head = q->cached_tail = 0;
+	q->tail = q->cached_head = 0;
+	q->idle = 0;
+	q->capacity = capacity;
+	q->mask = slots - 1;
+	q->items = (void **)malloc(slots * sizeof(void *));
+	assert(q->items);
+
+	return q;
 }
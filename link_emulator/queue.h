@@ -3,23 +3,83 @@
 
 #include "lib.h"
 
-struct q {
-  void* crt;
-  struct q* prev;
-};
-
-typedef struct q queue_entry;
-
+//fixed capacity FIFO of pointers, a ring over an array allocated once
 typedef struct {
   int size;
-  queue_entry* first;
-  queue_entry* last;
+  int capacity;
+  //index of the oldest entry
+  int head;
+  void** items;
 } queue;
 
-void enqueue(queue* q,void* m);
+//0, or -1 if the queue is full
+int enqueue(queue* q,void* m);
+//the oldest entry, NULL if empty
 void* dequeue(queue* q);
+//the oldest entry without taking it out, NULL if empty
+void* queue_peek(queue* q);
 
-queue* create_queue();
+queue* create_queue(int capacity);
 void destroy_queue(queue* q);
 
+//fixed capacity min-heap of pointers by key. Entries with the same
+//key come out in the order they went in.
+typedef struct {
+  unsigned long long key;
+  unsigned long long seq;
+  void* item;
+} pq_entry;
+
+typedef struct {
+  int size;
+  int capacity;
+  //entries pushed so far, orders equal keys
+  unsigned long long seq;
+  pq_entry* entries;
+} pqueue;
+
+//0, or -1 if the queue is full
+int pq_push(pqueue* q,unsigned long long key,void* m);
+//the entry with the smallest key, NULL if empty
+void* pq_pop(pqueue* q);
+//the smallest key, the queue must not be empty
+unsigned long long pq_min(pqueue* q);
+
+pqueue* create_pqueue(int capacity);
+
+#define CACHE_LINE 64
+
+//fixed capacity FIFO between exactly one producer thread and one
+//consumer thread, with no lock. Each side writes only its own index,
+//on a cache line of its own, and keeps a stale copy of the other one
+//so it reads the shared line only when the copy says full or empty.
+typedef struct {
+  //the producer's line
+  unsigned head __attribute__((aligned(CACHE_LINE)));
+  unsigned cached_tail;
+  //the consumer's line
+  unsigned tail __attribute__((aligned(CACHE_LINE)));
+  unsigned cached_head;
+  //1 while the consumer sleeps, waiting for an entry
+  int idle __attribute__((aligned(CACHE_LINE)));
+  //entries allowed, and the slots (a power of two at least as many)
+  int capacity;
+  unsigned mask;
+  void** items;
+} spsc_queue;
+
+//producer side: 0, or -1 if the queue is full
+int spsc_push(spsc_queue* q,void* m);
+//consumer side: the oldest entry, NULL if empty
+void* spsc_pop(spsc_queue* q);
+//consumer side: entries waiting
+int spsc_size(spsc_queue* q);
+//consumer side: sleep until there is an entry. The producer pays for
+//a wakeup only while the consumer sleeps.
+void spsc_wait(spsc_queue* q);
+//the same, giving up at deadline (ns of CLOCK_MONOTONIC)
+void spsc_wait_until(spsc_queue* q,unsigned long long deadline);
+
+spsc_queue* create_spsc(int capacity);
+
 #endif
@@ -0,0 +1,157 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+/* Nibble value meaning "more length bytes follow" */
+#define LZ_RUN_MASK 15
+
+static inline uint32_t read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline int hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write the extra bytes of a length that did not fit in its nibble */
+static int put_length(char *out, int op, int cap, int len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= cap) return -1;
+        out[op++] = (char)255;
+    }
+    if (op >= cap) return -1;
+    out[op++] = len;
+
+    return op;
+}
+
+static int get_length(const char *in, int *ip, int n, int len)
+{
+    unsigned char b;
+    do {
+        if (*ip >= n) return -1;
+        b = in[(*ip)++];
+        len += b;
+    } while (b == 255);
+
+    return len;
+}
+
+/* Emit lit_len literals followed, if match_len > 0, by a match of
+   match_len bytes starting offset bytes back */
+static int put_sequence(char *out, int op, int cap, const char *lits,
+                        int lit_len, int offset, int match_len)
+{
+    int m = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    if (op >= cap) return -1;
+    out[op++] = ((lit_len < LZ_RUN_MASK ? lit_len : LZ_RUN_MASK) << 4) |
+                (m < LZ_RUN_MASK ? m : LZ_RUN_MASK);
+    if (lit_len >= LZ_RUN_MASK) {
+        op = put_length(out, op, cap, lit_len - LZ_RUN_MASK);
+        if (op < 0) return -1;
+    }
+
+    if (op + lit_len > cap) return -1;
+    memcpy(out + op, lits, lit_len);
+    op += lit_len;
+
+    if (!match_len) return op;
+
+    if (op + 2 > cap) return -1;
+    out[op++] = offset & 0xff;
+    out[op++] = offset >> 8;
+    if (m >= LZ_RUN_MASK) {
+        op = put_length(out, op, cap, m - LZ_RUN_MASK);
+        if (op < 0) return -1;
+    }
+
+    return op;
+}
+
+int lz_compress(const char *in, int n, char *out, int cap)
+{
+    /* Positions plus one, so that 0 means empty */
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t v = read32(in + ip);
+        int h = hash(v);
+        int ref = table[h] - 1;
+        table[h] = ip + 1;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(in + ref) != v) {
+            ip++;
+            continue;
+        }
+
+        int len = LZ_MIN_MATCH;
+        while (ip + len < n && in[ref + len] == in[ip + len]) len++;
+
+        op = put_sequence(out, op, cap, in + anchor, ip - anchor, ip - ref, len);
+        if (op < 0) return -1;
+
+        ip += len;
+        anchor = ip;
+    }
+
+    /* The block ends with a sequence of literals only */
+    return put_sequence(out, op, cap, in + anchor, n - anchor, 0, 0);
+}
+
+int lz_decompress(const char *in, int n, char *out, int cap)
+{
+    int ip = 0, op = 0;
+
+    while (ip < n) {
+        unsigned char token = in[ip++];
+
+        /* Literals */
+        int lit_len = token >> 4;
+        if (lit_len == LZ_RUN_MASK) {
+            lit_len = get_length(in, &ip, n, lit_len);
+            if (lit_len < 0) return -1;
+        }
+        if (ip + lit_len > n || op + lit_len > cap) return -1;
+        memcpy(out + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        /* The last sequence has no match */
+        if (ip == n) break;
+
+        /* Match */
+        if (ip + 2 > n) return -1;
+        int offset = (unsigned char)in[ip] | ((unsigned char)in[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+
+        int match_len = token & LZ_RUN_MASK;
+        if (match_len == LZ_RUN_MASK) {
+            match_len = get_length(in, &ip, n, match_len);
+            if (match_len < 0) return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (op + match_len > cap) return -1;
+
+        /* Byte by byte, the match may overlap what it produces */
+        const char *ref = out + op - offset;
+        int i;
+        for (i = 0; i < match_len; i++) out[op + i] = ref[i];
+        op += match_len;
+    }
+
+    return op;
+}
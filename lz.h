@@ -0,0 +1,16 @@
+#ifndef LZ
+#define LZ
+
+/* A small LZ77 block compressor in the spirit of LZ4: sequences of
+   literals followed by a (offset, length) match, no entropy coding.
+   Every block is self contained. */
+
+/* Compress n bytes of in into out. Returns the compressed size, or -1
+   if it does not fit in cap bytes. */
+int lz_compress(const char *in, int n, char *out, int cap);
+
+/* Decompress n bytes of in into out. Returns the decompressed size, or
+   -1 if the block is damaged or would not fit in cap bytes. */
+int lz_decompress(const char *in, int n, char *out, int cap);
+
+#endif
@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pace.h"
+
+/* Gains of BBR: startup doubles the delivery rate every round trip and
+   drain empties the queue that built, then the rate cycles around the
+   estimate, a little above to find more and a little below to give
+   back what that queued. The window is two bandwidth-delay products
+   even in startup, as in BBRv2: nothing here is ever sent again, a
+   queue that overflows costs a whole transfer. */
+#define STARTUP_GAIN 2.885
+#define WINDOW_GAIN 2
+static const double cycle[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+#define CYCLE_PHASES (int)(sizeof(cycle) / sizeof(cycle[0]))
+
+/* Round trips the bandwidth estimate lasts, seconds the RTT one does */
+#define BW_ROUNDS 10
+#define RTT_SECONDS 10.0
+/* Startup ends after this many round trips without 25% more bandwidth */
+#define FULL_BW_ROUNDS 3
+#define FULL_BW_GROWTH 1.25
+/* Packages always allowed out at once */
+#define MIN_WINDOW 4
+/* A package is lost when not answered within this many smoothed round
+   trips, and never sooner than LOSS_FLOOR seconds */
+#define LOSS_RTTS 4
+#define LOSS_FLOOR 0.2
+/* An answer marked by a congested queue takes this share off the bytes
+   allowed in flight, once a round trip, as in BBRv2 */
+#define ECN_BETA 0.3
+/* Waits shorter than this are spun, the sleeps miss by about as much */
+#define SPIN_LIMIT 50e-6
+
+#define STARTUP 0
+#define DRAIN 1
+#define PROBE_BW 2
+
+static int enabled = 0;
+
+/* Parallel flows send and take answers on their own threads */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Bytes in flight went down */
+static pthread_cond_t window_open = PTHREAD_COND_INITIALIZER;
+
+static int state = STARTUP;
+/* Bytes confirmed so far, when the last of them were and when they had
+   left */
+static long long delivered = 0;
+static double delivered_time = 0, delivered_sent = 0;
+/* Bytes sent and not answered or lost yet, and their packages, oldest
+   first */
+static long long in_flight = 0;
+static pace_ticket *oldest = NULL, *newest = NULL;
+/* When the next package may leave */
+static double next_send = 0;
+/* Senders waiting for room in the window take a number, and go in turn */
+static unsigned long long waiting = 0, serving = 0;
+/* Largest package so far, the window holds a few whatever happens */
+static int largest = 0;
+
+/* A round trip ends with the answer to a package sent after it began */
+static long long round_count = 0, round_end = 0;
+
+/* Largest delivery rate (bytes per second) of each of the last round
+   trips, and the largest of them */
+static double bw_max[BW_ROUNDS];
+static long long bw_round[BW_ROUNDS];
+static double btl_bw = 0;
+
+static double min_rtt = 0, min_rtt_time = 0;
+static double srtt = 0;
+
+/* Startup: the bandwidth it last grew to */
+static double full_bw = 0;
+static int full_bw_rounds = 0;
+
+/* Probing: phase of the cycle and since when */
+static int phase = 0;
+static double phase_start = 0;
+
+/* Bytes in flight allowed since answers came marked, 0 for no more
+   than the window, and the round trip of the last mark */
+static double inflight_hi = 0;
+static long long marked_round = -1;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Seconds on either clock as the timespec the waits take */
+static struct timespec to_timespec(double t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+/* Sleep most of the way, spin the rest */
+static void sleep_until(double deadline)
+{
+    double t = deadline - SPIN_LIMIT;
+    struct timespec ts;
+
+    if (t > now()) {
+        ts = to_timespec(t);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+    while (now() < deadline)
+        ;
+}
+
+void pace_enable(int on)
+{
+    enabled = on;
+}
+
+int pace_enabled()
+{
+    return enabled;
+}
+
+static double bdp()
+{
+    return btl_bw * min_rtt;
+}
+
+static double pacing_gain()
+{
+    if (state == STARTUP) return STARTUP_GAIN;
+    if (state == DRAIN) return 1 / STARTUP_GAIN;
+    return cycle[phase];
+}
+
+static double loss_timeout()
+{
+    return LOSS_RTTS * srtt > LOSS_FLOOR ? LOSS_RTTS * srtt : LOSS_FLOOR;
+}
+
+static void uncount(pace_ticket *p)
+{
+    if (p->prev) p->prev->next = p->next;
+    else oldest = p->next;
+    if (p->next) p->next->prev = p->prev;
+    else newest = p->prev;
+
+    in_flight -= p->bytes;
+    p->counted = 0;
+}
+
+/* Give up on packages out for too long, their flows would otherwise
+   hold the window of the others forever */
+static void expire(double t)
+{
+    while (oldest && t - oldest->sent > loss_timeout()) uncount(oldest);
+}
+
+/* Bytes in flight that already left, the others wait for their slot */
+static long long on_the_wire(double t)
+{
+    long long bytes = 0;
+    pace_ticket *p;
+
+    for (p = oldest; p != NULL && p->sent <= t; p = p->next) bytes += p->bytes;
+
+    return bytes;
+}
+
+/* Bytes allowed in flight */
+static double window()
+{
+    double w = WINDOW_GAIN * bdp();
+    if (inflight_hi > 0 && inflight_hi < w) w = inflight_hi;
+    return w > MIN_WINDOW * largest ? w : MIN_WINDOW * largest;
+}
+
+void pace_send(pace_ticket *ticket, int bytes)
+{
+    double t, start;
+    int waited = 0;
+
+    ticket->bytes = 0;
+    if (!enabled) return;
+
+    pthread_mutex_lock(&lock);
+    if (bytes > largest) largest = bytes;
+
+    /* Until there is an estimate, anything goes */
+    unsigned long long turn = waiting++;
+    while (1) {
+        expire(now());
+        if (turn == serving &&
+            (btl_bw == 0 || in_flight == 0 || in_flight + bytes <= window()))
+            break;
+        waited = 1;
+        if (oldest == NULL) {
+            pthread_cond_wait(&window_open, &lock);
+            continue;
+        }
+
+        /* Until an answer, or until the oldest package is lost */
+        struct timespec ts;
+        double wait = oldest->sent + loss_timeout() - now();
+        if (wait < 0) wait = 0;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts = to_timespec(ts.tv_sec + ts.tv_nsec / 1e9 + wait);
+        pthread_cond_timedwait(&window_open, &lock, &ts);
+    }
+    serving++;
+    if (waiting != serving) pthread_cond_broadcast(&window_open);
+
+    /* Take the next slot, whoever else is waiting gets the one after */
+    t = now();
+    start = next_send > t ? next_send : t;
+    next_send = btl_bw > 0 ? start + bytes / (pacing_gain() * btl_bw) : start;
+
+    /* Coming back from idle: the rate counts from now */
+    if (in_flight == 0) delivered_time = delivered_sent = start;
+
+    ticket->sent = start;
+    ticket->delivered = delivered;
+    ticket->delivered_time = delivered_time;
+    ticket->delivered_sent = delivered_sent;
+    ticket->bytes = bytes;
+    ticket->limited = !waited && start == t;
+    ticket->counted = 1;
+    ticket->next = NULL;
+    ticket->prev = newest;
+    if (newest) newest->next = ticket;
+    else oldest = ticket;
+    newest = ticket;
+    in_flight += bytes;
+    pthread_mutex_unlock(&lock);
+
+    sleep_until(start);
+}
+
+/* Fold in the delivery rate and RTT sample of an answered package */
+static void sample(const pace_ticket *p, int marked)
+{
+    double t = now(), rtt = t - p->sent;
+    int i;
+
+    /* As long as the answers took, or the packages to leave if that was
+       longer: answers that come bunched do not make the link faster */
+    double interval = t - p->delivered_time;
+    if (p->sent - p->delivered_sent > interval) interval = p->sent - p->delivered_sent;
+
+    delivered += p->bytes;
+    delivered_time = t;
+    delivered_sent = p->sent;
+
+    if (rtt > 0 && (min_rtt == 0 || rtt < min_rtt || t - min_rtt_time > RTT_SECONDS)) {
+        min_rtt = rtt;
+        min_rtt_time = t;
+    }
+    srtt = srtt == 0 ? rtt : 0.875 * srtt + 0.125 * rtt;
+
+    int new_round = p->delivered >= round_end;
+    if (new_round) {
+        round_count++;
+        round_end = delivered;
+    }
+
+    /* Answers closer than a round trip came in a bunch, not at the rate
+       of the link */
+    if (interval > 0 && interval >= min_rtt) {
+        double bw = (delivered - p->delivered) / interval;
+
+        i = round_count % BW_ROUNDS;
+        if (bw_round[i] != round_count) {
+            bw_round[i] = round_count;
+            bw_max[i] = 0;
+        }
+        /* A sender that had nothing more to send says little about the
+           link, unless it went faster than we knew it could */
+        if ((!p->limited || bw >= btl_bw) && bw > bw_max[i]) bw_max[i] = bw;
+
+        btl_bw = 0;
+        for (i = 0; i < BW_ROUNDS; i++)
+            if (bw_round[i] > round_count - BW_ROUNDS && bw_max[i] > btl_bw) btl_bw = bw_max[i];
+    }
+
+    /* A queue is building somewhere on the way: hold back, and stop
+       looking for more in startup. Without marks the limit grows back
+       by a package every round trip until the window is bigger. */
+    if (marked && round_count != marked_round) {
+        inflight_hi = (1 - ECN_BETA) * window();
+        marked_round = round_count;
+        if (state == STARTUP) state = DRAIN;
+    } else if (new_round && inflight_hi > 0 && round_count > marked_round + 1) {
+        inflight_hi += largest;
+        if (inflight_hi >= WINDOW_GAIN * bdp()) inflight_hi = 0;
+    }
+
+    /* Every flow waits for its answer before the next package, so the
+       sender is nearly always limited by how many flows it has: the
+       bandwidth stops growing all the same once the link is full */
+    if (state == STARTUP && new_round) {
+        if (btl_bw >= full_bw * FULL_BW_GROWTH) {
+            full_bw = btl_bw;
+            full_bw_rounds = 0;
+        } else if (++full_bw_rounds >= FULL_BW_ROUNDS) {
+            state = DRAIN;
+        }
+    }
+    /* Draining is over once what left fits the link, however many
+       packages wait for the pacer */
+    if (state == DRAIN && on_the_wire(t) <= bdp()) {
+        state = PROBE_BW;
+        phase = 0;
+        phase_start = t;
+    }
+    /* A phase lasts a round trip, giving back ends once the queue is gone */
+    if (state == PROBE_BW &&
+        (t - phase_start > min_rtt || (cycle[phase] < 1 && on_the_wire(t) <= bdp()))) {
+        phase = (phase + 1) % CYCLE_PHASES;
+        phase_start = t;
+    }
+}
+
+void pace_answer(pace_ticket *ticket, int answered, int marked)
+{
+    if (ticket->bytes == 0) return;
+
+    pthread_mutex_lock(&lock);
+    if (ticket->counted) uncount(ticket);
+    if (answered) sample(ticket, marked);
+    pthread_cond_broadcast(&window_open);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,42 @@
+#ifndef PACE
+#define PACE
+
+/* Pacing of the packages the server sends, BBR style.
+
+   Every confirmed package is a delivery rate sample: the bytes
+   confirmed between its sending and its answer over the time that
+   took. The bottleneck bandwidth is the largest sample of the last few
+   round trips, the round trip time the smallest of the last seconds.
+   Packages then leave spaced to that bandwidth (times a gain that
+   probes for more now and then), and no more than two bandwidth-delay
+   products are out at once, fewer after answers marked by a congested
+   queue (see recv_marked()). A package not answered within a few round
+   trips no longer counts as out. The estimates are shared by every
+   flow of the server, so parallel flows pace together. */
+
+typedef struct pace_ticket {
+    /* When it left, and the bytes confirmed by then, when, and when the
+       last of them had left */
+    double sent;
+    long long delivered;
+    double delivered_time, delivered_sent;
+    /* On the wire */
+    int bytes;
+    /* Left without waiting for the pacer: nothing else to send */
+    int limited;
+    /* Still counted in flight, or given up for lost */
+    int counted;
+    struct pace_ticket *prev, *next;
+} pace_ticket;
+
+void pace_enable(int on);
+int pace_enabled();
+
+/* Wait until a package of bytes bytes on the wire may leave */
+void pace_send(pace_ticket *ticket, int bytes);
+
+/* The package of ticket got its answer, or will not (answered 0);
+   marked if the answer says a queue on the way is building */
+void pace_answer(pace_ticket *ticket, int answered, int marked);
+
+#endif
@@ -0,0 +1,101 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+static void futex_wait(unsigned *word, unsigned value)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Announce a change to the other side, a syscall only if it sleeps */
+static void changed(ring *q)
+{
+    __atomic_add_fetch(&q->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST))
+        futex_wake(&q->seq);
+}
+
+/* Sleep until the other side changes something after seq was s */
+static void wait_change(ring *q, unsigned s)
+{
+    futex_wait(&q->seq, s);
+    __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+void ring_init(ring *q, unsigned size)
+{
+    q->head = q->tail = q->seq = 0;
+    q->sleepers = 0;
+    q->closed = 0;
+    q->size = size;
+}
+
+int ring_produce(ring *q)
+{
+    for (;;) {
+        unsigned head = q->head;
+        if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) return -1;
+        if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) < q->size)
+            return head % q->size;
+
+        /* Full. Register first, then look again, so that a change made
+           after the look moves seq and the wait returns at once. */
+        __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+        unsigned s = __atomic_load_n(&q->seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST) ||
+            head - __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) < q->size) {
+            __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        wait_change(q, s);
+    }
+}
+
+void ring_produced(ring *q)
+{
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    changed(q);
+}
+
+int ring_consume(ring *q)
+{
+    for (;;) {
+        unsigned tail = q->tail;
+        if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != tail)
+            return tail % q->size;
+        if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+            /* The producer may have published right before closing */
+            if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != tail) continue;
+            return -1;
+        }
+
+        __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+        unsigned s = __atomic_load_n(&q->seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST) ||
+            __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) != tail) {
+            __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        wait_change(q, s);
+    }
+}
+
+void ring_consumed(ring *q)
+{
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+    changed(q);
+}
+
+void ring_close(ring *q)
+{
+    __atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+    changed(q);
+}
@@ -0,0 +1,34 @@
+#ifndef RING
+#define RING
+
+/* Bounded single producer, single consumer queue over a ring of slots
+   the caller preallocates. The producer fills slot ring_produce() in
+   place and publishes it with ring_produced(); the consumer reads slot
+   ring_consume() and gives it back with ring_consumed(). Nothing is
+   locked: the two counters are atomics, and a side only sleeps (on a
+   futex) when the ring is full or empty. */
+typedef struct {
+    /* Slots published and slots given back, both only ever grow */
+    unsigned head, tail;
+    /* Bumped on every change, the word sleepers wait on */
+    unsigned seq;
+    int sleepers;
+    int closed;
+    unsigned size;
+} ring;
+
+void ring_init(ring *q, unsigned size);
+
+/* Slot to fill next, waiting while the ring is full. -1 once closed. */
+int ring_produce(ring *q);
+void ring_produced(ring *q);
+
+/* Slot to read next, waiting while the ring is empty. -1 once closed
+   and drained. */
+int ring_consume(ring *q);
+void ring_consumed(ring *q);
+
+/* Either side stops the queue; whoever waits on it wakes up */
+void ring_close(ring *q);
+
+#endif
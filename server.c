@@ -1,711 +1,1623 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <glob.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 
 #include "lib.h"
+#include "codec.h"
+#include "tune.h"
+#include "lz.h"
+#include "hash.h"
+#include "stream.h"
+#include "cdc.h"
+#include "ring.h"
+#include "writer.h"
+#include "tree.h"
+#include "digest.h"
+#include "fcache.h"
+#include "pace.h"
 
 #define HOST "127.0.0.1"
 #define PORT 10001
 
-/* Possible running modes */
-#define RUN_PARITY_MODE "parity"
-#define RUN_HAMMING_MODE "hamming"
-#define NORMAL  1
-#define PARITY  2
-#define HAMMING 3
-
 /* Possible commands */
 #define LS "ls\0"
 #define CD "cd\0"
 #define CP "cp\0"
 #define SN "sn\0"
+#define SZ "sz\0"
+#define AT "at\0"
+#define CZ "cz\0"
+#define DS "ds\0"
+#define DG "dg\0"
+#define CR "cr\0"
+#define PR "pr\0"
+#define TG "tg\0"
+#define TP "tp\0"
+#define MG "mg\0"
+#define HS "hs\0"
+#define FL "fl\0"
+#define PC "pc\0"
 #define EXIT "exit\0"
 
-/* Confirmations */
-#define ACK "ACK"
-#define NACK "NACK"
-
 /* Other flags */
 #define END_TRANSMISSION -1
 #define EXITED_NORMALLY 1
 
-/* Bit manipulation */
-#define get_bit(x, pos) (((x >> pos) & 1) == 1 ? 1 : 0)
+/* Datagram size negotiation */
+#define MIN_MSGSIZE 64
+#define PROBE_TIMEOUT 500
+#define PROBE_TRIES 3
+#define PROBE_STEP 64
+
+/* Chunk framing while compression is on: a flag byte, then either the
+   raw bytes or the raw length (an int) and the compressed block */
+#define CHUNK_RAW 0
+#define CHUNK_PACKED 1
+#define PACKED_HEADER (1 + sizeof(int))
+#define MAX_RAW_CHUNK (1 << 20)
+#define MAX_PACK_SKIP 32
+
+/* cp pipeline: size and count of the disk reads in flight, and chunks
+   ready to send */
+#define READ_BLOCK (256 * 1024)
+#define READ_SLOTS 4
+#define CHUNK_SLOTS 32
+
+/* Start of the next file of a batch read ahead while one is sent */
+#define PREFETCH_BYTES (8 * 1024 * 1024)
+
+/* Follow mode: ms without news before the client hears from us, and
+   the client's answer that ends it */
+#define FOLLOW_IDLE 1000
+#define BYE "BYE"
+
+/* Delta upload: blocks of the basis and the client's instructions */
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK (1 << 17)
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_END 'E'
+
+/* Parallel range transfers: flows besides the main one */
+#define MAX_FLOWS 16
+
+/* Where the client is: HOST, or "shm:<name>" on the same host */
+char *host = HOST;
+
+/* 1 if cp/sn chunks of this session are compressed */
+int compression = 0;
+
+/* Compression state of one stream of chunks */
+typedef struct {
+    /* Raw bytes to take next time, follows the compression ratio */
+    int input;
+    /* Chunks to send raw before trying to pack again, and the next streak */
+    int skip, streak;
+} packer;
+
+void packer_init(packer *p)
+{
+    p->input = 0;
+    p->skip = 0;
+    p->streak = 1;
+}
 
-/* Tricks to help at hamming mode */
-/* Indexes for data bits */
-const int data_bits[8] = {1, 7, 6, 5, 3, 2, 1, 0};
-const int first_data_in_byte_2 = 1;
-/* Indexes of all control bits */
-const int control_bits[4] = {3, 2, 0, 4};
-/* Indexes needed to calculate the 0th control bit */
-const int c0_bit[6] = {3, 1, 7, 5, 3, 1};
-const int first_c0_in_byte_2 = 2;
-/* Indexes needed to calculate the 1st control bit */
-const int c1_bit[6] = {2, 1, 6, 5, 2, 1};
-const int first_c1_in_byte_2 = 2;
-/* Indexes needed to calculate the 2nd control bit */
-const int c2_bit[5] = {0, 7, 6, 5, 0};
-const int first_c2_in_byte_2 = 1;
-/* Indexes needed to calculate the 3rd control bit */
-const int c3_bit[5] = {4, 3, 2, 1, 0};
-const int first_c3_in_byte_2 = 0;
+/* How many raw bytes the next chunk of capacity bytes would take */
+int chunk_wanted(const packer *p, int capacity)
+{
+    if (!compression || p->skip || p->input < capacity) return capacity;
+    return p->input;
+}
 
-inline int get_ones(char x) 
+/* Put the next chunk of the n bytes of raw into data, which has room for
+   capacity bytes. With compression on, n should be what chunk_wanted()
+   asked for, as much as is expected to compress into the room; chunks
+   that do not compress even at capacity bytes go out raw and packing
+   is skipped for a while.
+   Returns how many raw bytes went into the chunk and sets *len to the
+   bytes used in data. */
+int pack_chunk(packer *p, const char *raw, int n, char *data, int capacity, int *len)
 {
-    int no_of_ones = 0;
-    while (x) {
-        x = x & (x - 1);
-        no_of_ones++;
+    int fit, packed = -1;
+
+    if (!compression) {
+        fit = n < capacity ? n : capacity;
+        memcpy(data, raw, fit);
+        *len = fit;
+        return fit;
+    }
+
+    int room = capacity - PACKED_HEADER;
+
+    /* A guess from the last ratio can be too much for the room: halve
+       it, down to a chunk's worth, before calling the data incompressible */
+    while (!p->skip && room > 0) {
+        packed = lz_compress(raw, n, data + PACKED_HEADER, room);
+        if (packed >= 0 || n <= capacity) break;
+        n = n / 2 > capacity ? n / 2 : capacity;
+    }
+    if (packed >= 0 && packed + PACKED_HEADER < 1 + n) {
+        data[0] = CHUNK_PACKED;
+        memcpy(data + 1, &n, sizeof(int));
+        *len = PACKED_HEADER + packed;
+
+        /* Aim a bit below what the last ratio would fill */
+        long long next = (long long)n * room / (packed ? packed : 1) * 7 / 8;
+        p->input = next > MAX_RAW_CHUNK ? MAX_RAW_CHUNK : next;
+        p->streak = 1;
+        return n;
+    }
+
+    if (p->skip) {
+        p->skip--;
+    } else {
+        p->skip = p->streak;
+        if (p->streak < MAX_PACK_SKIP) p->streak *= 2;
     }
+    p->input = capacity;
+
+    /* Send what fits as it is, the rest goes in the next chunks */
+    fit = n < capacity - 1 ? n : capacity - 1;
+    data[0] = CHUNK_RAW;
+    memcpy(data + 1, raw, fit);
+    *len = 1 + fit;
 
-    return (no_of_ones & 1);
+    return fit;
 }
 
-inline void set_parity(char* seq, int index, int parity)
+/* Get the file bytes out of a received chunk. Returns how many there
+   are and points *out to them, or -1 if the chunk is damaged. */
+int unpack_chunk(char *data, int len, char **out)
 {
-    int i;
-    for (i = 0; i < 8; i++) seq[index] &= ~(1 << i);
-    if (parity) seq[index] |= 1;
+    static __thread char raw[MAX_RAW_CHUNK];
+    int n;
+
+    *out = data;
+    if (!compression) return len;
+
+    if (len >= 1 && data[0] == CHUNK_RAW) {
+        *out = data + 1;
+        return len - 1;
+    }
+
+    if (len < PACKED_HEADER || data[0] != CHUNK_PACKED) return -1;
+    memcpy(&n, data + 1, sizeof(int));
+    if (n < 0 || n > MAX_RAW_CHUNK) return -1;
+    if (lz_decompress(data + PACKED_HEADER, len - PACKED_HEADER, raw, n) != n) return -1;
 
+    *out = raw;
+    return n;
 }
 
-inline int get_parity(char *seq, int starting_from, int seq_len)
-{   
-    int i;
-    int nb_ones = 0;
-    for (i = starting_from; i < seq_len; i++) {
-        nb_ones += get_ones(seq[i]);
+int execute_ls(char *argument, const codec *c)
+{
+    msg t;
+    int res;
+
+    /* Send confirmation for been receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
     }
 
-    /* Check the parity */
-    return (nb_ones & 1);
+    DIR *dir;
+    struct dirent *file_s;
+
+    /* Open directory */
+    if ((dir = opendir(argument)) == NULL) {
+        perror("[SERVER] Cannot open file\n");
+        return -1;
+    }
+
+    /* Start reading the dir and counting files */
+    int number_of_files = 0;
+    do {
+        errno = 0;
+        if ((file_s = readdir(dir)) != NULL) {
+            number_of_files++;
+        }
+    } while (file_s != NULL);
+
+    if (errno != 0) {
+        perror("[SERVER] Error while reading the dir\n");
+        return -1;
+    }
+
+    /* Send a package containing the number of files found in the argument dir */
+    char number[16];
+    sprintf(number, "%d", number_of_files);
+    put_string(c, &t, number);
+
+    res = send_confirmed(c, &t);
+    if (res < 0) {
+        perror("[SERVER] Send number of files found error\n");
+        return -1;
+    }
+
+    /* Walk through the directory again and send files names */
+    rewinddir(dir);
+    do {
+        if ((file_s = readdir(dir)) != NULL) {
+            /* Send current file name and wait for its confirmation */
+            put_string(c, &t, file_s->d_name);
+
+            res = send_confirmed(c, &t);
+            if (res < 0) {
+                perror("[SERVER] Error while sending current filename\n");
+                return -1;
+            }
+        }
+    } while (file_s != NULL);
+
+    closedir(dir);
+
+    return 1;
+}
+
+int execute_cd(char *argument)
+{
+    msg t;
+    int res;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    int ret = chdir(argument);
+    if (ret < 0) {
+        perror("[SERVER] Failed to change dir");
+        return -1;
+    }
+    fcache_chdir();
+
+    return 1;
 }
 
-inline int is_parity_correct(msg r)
+/* One cp transfer as a pipeline: a reader thread doing large sequential
+   reads, an encoder thread cutting, compressing and sealing chunks, and
+   the sender (the calling thread) waiting on the client. They hand
+   preallocated buffers to each other through rings, so a cold file goes
+   as fast as the slower of the disk and the link. */
+typedef struct {
+    int len;
+    char data[READ_BLOCK];
+} block;
+
+typedef struct {
+    const codec *c;
+    int fd;
+    int msgsize;
+    long long offset, length;
+    /* Reader -> encoder */
+    ring blocks;
+    block *block_slots;
+    /* Encoder -> sender */
+    ring chunks;
+    msg *chunk_slots;
+    /* Set by a stage that gave up before the end of the range */
+    int failed;
+} pipeline;
+
+void *read_stage(void *argument)
 {
-    /* First check the parity of bytes starting at pos 1 in the char seq */
-    int calculated_parity = get_parity(r.payload, 1, r.len);
-    int received_parity = get_bit(r.payload[0], 0);
+    pipeline *p = argument;
+    long long done = 0;
+
+    posix_fadvise(p->fd, p->offset, p->length, POSIX_FADV_SEQUENTIAL);
+
+    while (done < p->length) {
+        int slot = ring_produce(&p->blocks);
+        if (slot < 0) break;
+
+        /* Have the kernel fetch what comes after the blocks in flight */
+        long long ahead = p->offset + done + (long long)READ_SLOTS * READ_BLOCK;
+        if (ahead < p->offset + p->length)
+            posix_fadvise(p->fd, ahead, READ_BLOCK, POSIX_FADV_WILLNEED);
+
+        block *b = &p->block_slots[slot];
+        long long left = p->length - done;
+        b->len = pread(p->fd, b->data, left < READ_BLOCK ? left : READ_BLOCK, p->offset + done);
+        if (b->len <= 0) {
+            perror("[SERVER] Failed to read the file\n");
+            p->failed = 1;
+            break;
+        }
+        done += b->len;
+        ring_produced(&p->blocks);
+    }
 
-    /* Check the results */
-    if (calculated_parity == received_parity) return 1;
-    return 0;
+    ring_close(&p->blocks);
+
+    return NULL;
+}
+
+void *encode_stage(void *argument)
+{
+    pipeline *p = argument;
+    const codec *c = p->c;
+    /* Raw bytes not cut into chunks yet, one chunk may span blocks */
+    char *raw = malloc(MAX_RAW_CHUNK + READ_BLOCK);
+    int pos = 0, avail = 0, eof = 0;
+    long long sent = 0;
+    packer pk;
+
+    packer_init(&pk);
+    while (sent < p->length) {
+        /* Each and every package carries as much as the codec fits in
+           the datagram size of the session, or what the autotuning
+           finds best */
+        int capacity = c->capacity(p->msgsize);
+        if (tune_enabled()) capacity = tune_capacity(c, p->msgsize);
+
+        int wanted = chunk_wanted(&pk, capacity);
+        if (wanted > p->length - sent) wanted = p->length - sent;
+        while (avail < wanted && !eof) {
+            int slot = ring_consume(&p->blocks);
+            if (slot < 0) {
+                eof = 1;
+                break;
+            }
+            memmove(raw, raw + pos, avail);
+            pos = 0;
+            memcpy(raw + avail, p->block_slots[slot].data, p->block_slots[slot].len);
+            avail += p->block_slots[slot].len;
+            ring_consumed(&p->blocks);
+        }
+        if (avail == 0) {
+            p->failed = 1;
+            break;
+        }
+
+        int slot = ring_produce(&p->chunks);
+        if (slot < 0) break;
+
+        msg *t = &p->chunk_slots[slot];
+        int len, used;
+        used = pack_chunk(&pk, raw + pos, avail < wanted ? avail : wanted,
+                          codec_data(c, t), capacity, &len);
+        t->len = c->header + len;
+        c->seal(t);
+        ring_produced(&p->chunks);
+
+        pos += used;
+        avail -= used;
+        sent += used;
+    }
+
+    /* Stop the reader too if we stopped early */
+    ring_close(&p->blocks);
+    ring_close(&p->chunks);
+    free(raw);
+
+    return NULL;
+}
+
+/* Send a NACK in place of the package t was meant to carry */
+void refuse(msg *t)
+{
+    sprintf(t->payload, NACK);
+    t->len = strlen(NACK) + 1;
+    send_message(t);
 }
 
-int wait_until_ack(msg* r, msg* t)
+/* Send length bytes of f starting at offset: first the package head
+   (whose confirmation is left in answer), then the chunks, each
+   confirmed by the client. A NACK goes instead of the head if the
+   transfer cannot start. */
+int send_range_after(const codec *c, int fd, long long offset, long long length,
+                     msg *head, msg *answer)
 {
     int res;
+    pipeline p;
+    pthread_t reader, encoder;
+
+    p.c = c;
+    p.fd = fd;
+    p.msgsize = get_msgsize();
+    p.offset = offset;
+    p.length = length;
+    p.failed = 0;
+    ring_init(&p.blocks, READ_SLOTS);
+    ring_init(&p.chunks, CHUNK_SLOTS);
+    p.block_slots = malloc(READ_SLOTS * sizeof(block));
+    p.chunk_slots = malloc(CHUNK_SLOTS * sizeof(msg));
+    if (p.block_slots == NULL || p.chunk_slots == NULL) {
+        perror("[SERVER] Cannot allocate the transfer buffers\n");
+        free(p.block_slots);
+        free(p.chunk_slots);
+        refuse(head);
+        return -1;
+    }
 
-    if (r->len == 5) {
-        do {
-            /* Send again the package */
-            res = send_message(t);
-            if (res < 0) {
-                perror("[SERVER] Error while sending again\n");
-                return -1;
-            } else {
+    /* The disk starts while the head goes out */
+    if (pthread_create(&reader, NULL, read_stage, &p) != 0) {
+        perror("[SERVER] Cannot start the reader\n");
+        free(p.block_slots);
+        free(p.chunk_slots);
+        refuse(head);
+        return -1;
+    }
+    if (pthread_create(&encoder, NULL, encode_stage, &p) != 0) {
+        perror("[SERVER] Cannot start the encoder\n");
+        ring_close(&p.blocks);
+        pthread_join(reader, NULL);
+        free(p.block_slots);
+        free(p.chunk_slots);
+        refuse(head);
+        return -1;
+    }
+
+    res = send_answered(c, head, answer);
+    if (res < 0) {
+        perror("[SERVER] Error while sending file length. Exiting.\n");
+    }
+
+    /* Send the chunks and wait for the confirmation that each was
+       received by the client */
+    int slot;
+    while (res >= 0 && (slot = ring_consume(&p.chunks)) >= 0) {
+        res = send_confirmed(c, &p.chunk_slots[slot]);
+        if (res < 0) {
+            perror("[SERVER] Failed to send one chunk of data\n");
+        }
+        ring_consumed(&p.chunks);
+    }
+
+    /* Unblock the other stages if we stopped early */
+    ring_close(&p.chunks);
+    pthread_join(encoder, NULL);
+    pthread_join(reader, NULL);
+    free(p.block_slots);
+    free(p.chunk_slots);
+
+    if (res < 0) return -1;
+    if (p.failed) {
+        perror("[SERVER] Failed to read one chunk of data\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+/* A range as cp sends it: a package with the length, then the chunks */
+int send_range(const codec *c, int fd, long long offset, long long length)
+{
+    msg t, r;
+
+    /* Send a package containing the length of the range */
+    char number[24];
+    sprintf(number, "%lld", length);
+    put_string(c, &t, number);
+
+    return send_range_after(c, fd, offset, length, &t, &r);
+}
+
+/* Clip a range to a file of size bytes */
+void clip_range(long long size, long long *offset, long long *length)
+{
+    if (*offset < 0) *offset = 0;
+    if (*offset > size) *offset = size;
+    if (*length < 0 || *length > size - *offset) *length = size - *offset;
+}
+
+int execute_cp(char *argument, const codec *c)
+{
+    msg t;
+    int res;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    /* Open the file received as a parameter, or find it open */
+    struct stat st;
+    int fd = fcache_open(argument, &st);
+    if (fd < 0) {
+        perror("[SERVER] Cannot open file\n");
+        return -1;
+    }
+
+    /* Send the whole of it */
+    res = send_range(c, fd, 0, st.st_size);
+
+    /* Done with the file */
+    fcache_release(fd);
+
+    return res;
+}
+
+/* cr <name> <offset> <length>: cp of a part of the file, e.g. to resume
+   an interrupted one. A negative length means up to the end. */
+int execute_cr(char *argument, const codec *c)
+{
+    msg t;
+    int res;
+    char name[256];
+    long long offset = 0, length = -1;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    if (sscanf(argument, "%255s %lld %lld", name, &offset, &length) < 1) {
+        printf("[SERVER] Bad range request %s\n", argument);
+        return -1;
+    }
+
+    struct stat st;
+    int fd = fcache_open(name, &st);
+    if (fd < 0) {
+        perror("[SERVER] Cannot open file\n");
+        return -1;
+    }
+
+    clip_range(st.st_size, &offset, &length);
+    res = send_range(c, fd, offset, length);
+    fcache_release(fd);
+
+    return res;
+}
+
+/* One range of a parallel transfer, served on a flow of its own */
+typedef struct {
+    const codec *c;
+    /* Shared by all the flows, they read it with pread */
+    int fd;
+    int flow;
+    int msgsize;
+    long long offset, length;
+    /* Held until every flow was started and opened counts them */
+    pthread_mutex_t *created;
+    /* Passed twice: once every flow tried to open, then once *start
+       says whether they all did */
+    pthread_barrier_t *opened;
+    const int *start;
+    /* 1 if the flow has its socket */
+    int open;
+    int res;
+} range_job;
+
+void *serve_range(void *argument)
+{
+    range_job *job = argument;
+    msg r;
+
+    /* Every flow has its own socket, towards its own pair of ports */
+    job->res = -1;
+    job->open = try_init(host, PORT + 2 * job->flow) == 0;
+    if (job->open) {
+        set_msgsize(job->msgsize);
+        set_trim(tune_enabled());
+    }
+    pthread_mutex_lock(job->created);
+    pthread_mutex_unlock(job->created);
+    pthread_barrier_wait(job->opened);
+    pthread_barrier_wait(job->opened);
+
+    /* The client says it is listening on this flow, then the range goes */
+    if (job->open && *job->start && recv_message(&r) >= 0)
+        job->res = send_range(job->c, job->fd, job->offset, job->length);
+
+    if (job->open) finish();
+
+    return NULL;
+}
+
+/* pr <name> <offset1> <length1> ... : serve several ranges of one file
+   at once, range i on flow i (ports PORT + 2 * i on the link). Once all
+   the flows are open the server says how many there are, or NACKs if
+   one could not be started or opened; the client then sends one
+   package on each flow to start it. The command ends with an ACK on the
+   main flow when every range was delivered. */
+int execute_pr(char *argument, const codec *c)
+{
+    msg t;
+    int res;
+    char name[256];
+    range_job jobs[MAX_FLOWS];
+    pthread_t threads[MAX_FLOWS];
+    pthread_barrier_t opened;
+    int flows = 0, used, start = 1;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    if (sscanf(argument, "%255s%n", name, &used) < 1) {
+        printf("[SERVER] Bad range request %s\n", argument);
+        return -1;
+    }
+    argument += used;
+
+    struct stat st;
+    int fd = fcache_open(name, &st);
+    if (fd < 0) {
+        perror("[SERVER] Cannot open file\n");
+        return -1;
+    }
+    long long size = st.st_size;
+
+    while (flows < MAX_FLOWS &&
+           sscanf(argument, "%lld %lld%n", &jobs[flows].offset, &jobs[flows].length, &used) == 2) {
+        argument += used;
+        clip_range(size, &jobs[flows].offset, &jobs[flows].length);
+        flows++;
+    }
+
+    int i, started;
+    pthread_mutex_t created = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&created);
+    for (started = 0; started < flows; started++) {
+        jobs[started].c = c;
+        jobs[started].fd = fd;
+        jobs[started].flow = started + 1;
+        jobs[started].msgsize = get_msgsize();
+        jobs[started].created = &created;
+        jobs[started].opened = &opened;
+        jobs[started].start = &start;
+        if (pthread_create(&threads[started], NULL, serve_range, &jobs[started]) != 0) {
+            printf("[SERVER] Cannot start flow %d of %d\n", started + 1, flows);
+            start = 0;
+            break;
+        }
+    }
+    /* Only the flows that started wait on the barrier */
+    pthread_barrier_init(&opened, NULL, started + 1);
+    pthread_mutex_unlock(&created);
+    pthread_barrier_wait(&opened);
+    for (i = 0; i < started; i++) {
+        if (!jobs[i].open) {
+            printf("[SERVER] Cannot open flow %d of %d\n", i + 1, flows);
+            start = 0;
+        }
+    }
+    pthread_barrier_wait(&opened);
+
+    /* Every flow is open, tell the client how many there are */
+    if (start) {
+        char number[16];
+        sprintf(number, "%d", flows);
+        put_string(c, &t, number);
+        res = send_confirmed(c, &t);
+    } else {
+        sprintf(t.payload, NACK);
+        t.len = strlen(NACK) + 1;
+        res = send_message(&t);
+    }
+
+    int delivered = 0;
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].res > 0) delivered++;
+    }
+    pthread_barrier_destroy(&opened);
+    fcache_release(fd);
+
+    if (res < 0) {
+        perror("[SERVER] Error while sending the number of flows\n");
+        return -1;
+    }
+    if (!start) return -1;
+
+    /* Tell the client whether every range made it */
+    if (delivered == flows) {
+        res = send_ack(&t);
+    } else {
+        printf("[SERVER] %d of %d ranges failed\n", flows - delivered, flows);
+        sprintf(t.payload, NACK);
+        t.len = strlen(NACK) + 1;
+        res = send_message(&t);
+    }
+
+    return res < 0 ? -1 : 1;
+}
+
+int execute_sn(char* argument, const codec *c)
+{
+    msg t, r;
+    int res;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    /* sn <name> [none|end|periodic] [direct]: the durability policy of
+       the upload, none by default, and whether to bypass the page cache */
+    char name[240], policy[16] = "none", direct[16] = "";
+    if (sscanf(argument, "%239s %15s %15s", name, policy, direct) < 1 ||
+        durability_policy(policy) < 0) {
+        printf("[SERVER] Bad upload request %s\n", argument);
+        return -1;
+    }
+
+    /* Create the file sent as an argument. The data reaches it from a
+       background writer, the ACKs of the chunks do not wait for the
+       disk. A last ACK, or NACK, says whether it all got there. */
+    char filename[256];
+    strcpy(filename, "new_");
+    strcat(filename, name);
+    writer w;
+    if (writer_open(&w, filename, durability_policy(policy), !strcmp(direct, "direct")) < 0) {
+        perror("[SERVER] Cannot create file\n");
+        return -1;
+    }
+
+    /* Receive the package with the data length to write in the file */
+    res = recv_message(&r);
+    if (res < 0 || c->open(&r, &t) < 0) {
+        perror("[SERVER] Receive length of file to write error\n");
+        writer_close(&w);
+        return -1;
+    }
+
+    int i;
+    int file_length = 0;
+    char *data = codec_data(c, &r);
+    for (i = 0; i < codec_data_len(c, &r) - 1; i++) {
+        file_length = file_length * 10 + (data[i] - '0');
+    }
+
+    /* Send confirmation for receiving the file_length */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        writer_close(&w);
+        return -1;
+    }
+
+    /* Receive chunks of data and write them into the new created file.
+       The client decides the size of each of them. */
+    int received, package, len, failed = 0;
+    for (received = 0, package = 1; received < file_length; package++) {
+        res = recv_message(&r);
+        if (res < 0 || c->open(&r, &t) < 0) {
+            perror("[SERVER] Error while receiving chunk of data\n");
+            writer_close(&w);
+            return -1;
+        }
+
+        len = unpack_chunk(codec_data(c, &r), codec_data_len(c, &r), &data);
+        if (len < 0) {
+            /* Ask for the chunk again */
+            printf("[SERVER] Received damaged chunk %d\n", package);
+            sprintf(t.payload, NACK);
+            t.len = strlen(NACK) + 1;
+            send_message(&t);
+            continue;
+        }
+
+        /* Hand the data to the writer. It fails only if an earlier
+           write did; the rest of the chunks are then taken and dropped
+           so that the NACK at the end reaches the client in turn. */
+        if (!failed && writer_write(&w, data, len) < 0) {
+            printf("[SERVER] Failed to write chunk %d of data in the file\n", package);
+            failed = 1;
+        }
+        received += len;
+
+        /* Send confirmation that data was received successfully. With
+           autotuning on, it also tells the client the next chunk size. */
+        if (tune_enabled()) {
+            sprintf(t.payload, "%s %d", ACK, tune_capacity(c, get_msgsize()));
+            t.len = strlen(t.payload) + 1;
+            res = send_message(&t);
+        } else {
+            res = send_ack(&t);
+        }
+        if (res < 0) {
+            perror("[SERVER] Send ACK error. Exiting.\n");
+            writer_close(&w);
+            return -1;
+        }
+    }
+
+    /* Write out the rest and close the file, then tell the client
+       whether it is all on disk */
+    if (writer_close(&w) < 0) failed = 1;
+    if (failed) {
+        printf("[SERVER] Failed to write %s\n", filename);
+        sprintf(t.payload, NACK);
+        t.len = strlen(NACK) + 1;
+        send_message(&t);
+        return -1;
+    }
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Block size for a delta against a basis of length bytes: about the
+   square root of the length, as rsync does */
+int delta_block_size(long long length)
+{
+    int block = DELTA_MIN_BLOCK;
+    while ((long long)block * block < length && block < DELTA_MAX_BLOCK) block *= 2;
+
+    return block;
+}
+
+/* Rebuild a file into out from the client's instructions: copies of
+   basis blocks and literal data, through buf (block bytes). Returns 1 if
+   all of it was written and matches the length and hash the client
+   announced at the end, 0 if not, -1 if the transfer broke. */
+int apply_delta(stream *s, FILE *basis, int block, int blocks, char *buf, FILE *out)
+{
+    xxh64_state st;
+    long long written = 0;
+    uint64_t length, digest;
+    uint32_t index, count;
+    char op;
+    int n, res = 1, consistent = 1;
+
+    xxh64_reset(&st, 0);
+
+    while (res > 0) {
+        if (stream_read(s, &op, 1) < 0) {
+            res = -1;
+            break;
+        }
+
+        if (op == DELTA_COPY) {
+            if (stream_read(s, &index, sizeof(index)) < 0 ||
+                stream_read(s, &count, sizeof(count)) < 0) {
+                res = -1;
+                break;
+            }
+            if (!consistent) continue;
+            if ((long long)index + count > blocks) {
+                /* Keep reading to the end, the result is lost anyway */
+                printf("[SERVER] Delta refers to a block we do not have\n");
+                consistent = 0;
+                continue;
+            }
+            if (fseek(basis, (long)index * block, SEEK_SET) < 0) {
+                perror("[SERVER] Cannot seek in the basis\n");
+                consistent = 0;
+                continue;
             }
 
-            /* Wait for the confirmation */
-            res = recv_message(r);
-            if (res < 0) {
-                perror("[SERVER] Error, confirmation not received\n");
-                return -1;
+            for (; count > 0 && consistent; count--) {
+                n = fread(buf, sizeof(char), block, basis);
+                if (fwrite(buf, sizeof(char), n, out) != n) {
+                    perror("[SERVER] Cannot write the rebuilt file\n");
+                    consistent = 0;
+                }
+                xxh64_update(&st, buf, n);
+                written += n;
+            }
+        } else if (op == DELTA_LITERAL) {
+            if (stream_read(s, &count, sizeof(count)) < 0) {
+                res = -1;
+                break;
+            }
+
+            for (; count > 0; count -= n) {
+                n = count < block ? count : block;
+                if (stream_read(s, buf, n) < 0) {
+                    res = -1;
+                    break;
+                }
+                if (!consistent) continue;
+                if (fwrite(buf, sizeof(char), n, out) != n) {
+                    perror("[SERVER] Cannot write the rebuilt file\n");
+                    consistent = 0;
+                }
+                xxh64_update(&st, buf, n);
+                written += n;
             }
+        } else if (op == DELTA_END) {
+            if (stream_read(s, &length, sizeof(length)) < 0 ||
+                stream_read(s, &digest, sizeof(digest)) < 0) {
+                res = -1;
+                break;
+            }
+            res = consistent && written == length && digest == xxh64_digest(&st);
+            break;
+        } else {
+            printf("[SERVER] Unknown delta instruction %d\n", op);
+            res = -1;
+        }
+    }
+
+    return res;
+}
+
+/* ds <name>: upload a file as a delta against the copy we hold. The
+   server sends "<block> <blocks>" and the checksums of every block of
+   the basis, the client streams back the delta, and the server ACKs if
+   the rebuilt file checks out and is written, NACKs if not. A NACK in
+   place of the block size means the upload cannot be taken at all. */
+int execute_ds(char *argument, const codec *c)
+{
+    msg t;
+    int res;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    /* The copy we already hold: the last upload of the file, or the file itself */
+    char filename[256], partname[262];
+    if (snprintf(filename, sizeof(filename), "new_%s", argument) >= sizeof(filename) ||
+        snprintf(partname, sizeof(partname), "%s.part", filename) >= sizeof(partname)) {
+        printf("[SERVER] Name too long for a delta upload\n");
+        sprintf(t.payload, NACK);
+        t.len = strlen(NACK) + 1;
+        send_message(&t);
+        return -1;
+    }
+    FILE *basis = fopen(filename, "r");
+    if (basis == NULL) basis = fopen(argument, "r");
+
+    long long basis_length = 0;
+    if (basis != NULL) {
+        fseek(basis, 0L, SEEK_END);
+        basis_length = ftell(basis);
+        fseek(basis, 0L, SEEK_SET);
+    }
+
+    /* Rebuild the file next to the basis, then put it in place */
+    int block = delta_block_size(basis_length);
+    int blocks = (basis_length + block - 1) / block;
+    char *buf = malloc(block);
+    FILE *f = buf != NULL ? fopen(partname, "w") : NULL;
+    if (f == NULL) {
+        perror("[SERVER] Cannot create file\n");
+        free(buf);
+        if (basis) fclose(basis);
+        sprintf(t.payload, NACK);
+        t.len = strlen(NACK) + 1;
+        send_message(&t);
+        return -1;
+    }
+
+    /* Tell the client how the basis is cut in blocks */
+    char header[32];
+    sprintf(header, "%d %d", block, blocks);
+    put_string(c, &t, header);
+
+    res = send_confirmed(c, &t);
+    if (res < 0) {
+        perror("[SERVER] Error while sending the block size\n");
+    }
+
+    /* Send the rolling and strong checksum of every block */
+    stream s;
+    stream_init(&s, c);
+    int i, n;
+    for (i = 0; i < blocks && res > 0; i++) {
+        n = fread(buf, sizeof(char), block, basis);
+        uint32_t weak = rolling_checksum(buf, n);
+        uint64_t strong = xxh64(buf, n, 0);
+
+        res = stream_write(&s, &weak, sizeof(weak));
+        if (res > 0) res = stream_write(&s, &strong, sizeof(strong));
+    }
+    if (res > 0) res = stream_flush(&s);
+    if (res < 0) {
+        perror("[SERVER] Error while sending the block checksums\n");
+    }
+
+    if (res > 0) {
+        stream_init(&s, c);
+        res = apply_delta(&s, basis, block, blocks, buf, f);
+        if (res < 0) perror("[SERVER] Error while receiving the delta\n");
+    }
+
+    /* Only a file that made it to the disk whole goes in place */
+    if (fclose(f) != 0 && res > 0) {
+        perror("[SERVER] Cannot write the rebuilt file\n");
+        res = 0;
+    }
+    if (res > 0 && rename(partname, filename) < 0) {
+        perror("[SERVER] Cannot put the rebuilt file in place\n");
+        res = 0;
+    }
+    if (res <= 0) unlink(partname);
+    free(buf);
+    if (basis) fclose(basis);
+
+    /* Tell the client whether the rebuilt file checks out */
+    if (res > 0) {
+        res = send_ack(&t);
+    } else {
+        printf("[SERVER] Rebuilt %s is not right, discarded\n", filename);
+        sprintf(t.payload, NACK);
+        t.len = strlen(NACK) + 1;
+        send_message(&t);
+        res = -1;
+    }
+
+    return res < 0 ? -1 : 1;
+}
+
+/* dg <name>: get the chunks of a file the client does not have (see
+   cdc.h). The server sends "<size> <count>" and streams the hash and
+   length of every chunk; the client streams back how many it wants
+   and their indexes, and gets those chunks in one stream, or a NACK
+   if it asked for one the file does not have. A file that cannot be
+   read or indexed gets a NACK in place of "<size> <count>". */
+int execute_dg(char *argument, const codec *c)
+{
+    msg t;
+    int res;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    /* A file we cannot open or index gets a NACK instead of its size */
+    const cdc_index *idx = cdc_lookup(argument);
+    FILE *f = fopen(argument, "r");
+    if (idx == NULL || f == NULL) {
+        perror("[SERVER] Cannot open or index file\n");
+        if (f) fclose(f);
+        sprintf(t.payload, NACK);
+        t.len = strlen(NACK) + 1;
+        send_message(&t);
+        return -1;
+    }
+
+    /* Send the length of the file and how many chunks it is made of */
+    char header[48];
+    sprintf(header, "%lld %d", idx->size, idx->count);
+    put_string(c, &t, header);
+
+    res = send_confirmed(c, &t);
+    if (res < 0) {
+        perror("[SERVER] Error while sending file length. Exiting.\n");
+        fclose(f);
+        return -1;
+    }
+
+    /* Send the name and length of every chunk */
+    stream s;
+    stream_init(&s, c);
+    int i;
+    for (i = 0, res = 1; i < idx->count && res > 0; i++) {
+        uint32_t length = idx->chunks[i].length;
+        res = stream_write(&s, &idx->chunks[i].hash, sizeof(uint64_t));
+        if (res > 0) res = stream_write(&s, &length, sizeof(length));
+    }
+    if (res > 0) res = stream_flush(&s);
+
+    /* The client answers with the chunks it does not have yet. The list
+       is read to the end even if it cannot be served, so that the
+       client hears about it in turn. */
+    uint32_t wanted = 0, index = 0;
+    int rejected = 0;
+    stream_init(&s, c);
+    if (res > 0) res = stream_read(&s, &wanted, sizeof(wanted));
+    if (wanted > idx->count) wanted = idx->count;
+    uint32_t *list = malloc(wanted * sizeof(uint32_t) + 1);
+    char *buf = malloc(CDC_MAX_CHUNK);
+    if (list == NULL || buf == NULL) {
+        perror("[SERVER] Cannot allocate the chunk list\n");
+        rejected = 1;
+    }
+    for (i = 0; i < wanted && res > 0; i++) {
+        res = stream_read(&s, &index, sizeof(index));
+        if (res > 0 && index >= idx->count) {
+            printf("[SERVER] Client wants chunk %u of %d\n", index, idx->count);
+            rejected = 1;
+        }
+        if (!rejected) list[i] = index;
+    }
+
+    /* A list we cannot serve gets a NACK instead of the chunks */
+    if (res > 0 && rejected) {
+        sprintf(t.payload, NACK);
+        t.len = strlen(NACK) + 1;
+        send_message(&t);
+        free(buf);
+        free(list);
+        fclose(f);
+        return -1;
+    }
+
+    /* And gets just those, in the order it asked */
+    stream_init(&s, c);
+    for (i = 0; i < wanted && res > 0; i++) {
+        const cdc_chunk *chunk = &idx->chunks[list[i]];
+        fseek(f, chunk->offset, SEEK_SET);
+        int n = fread(buf, sizeof(char), chunk->length, f);
+        if (n != chunk->length) {
+            /* Changed under us, the client sees it in the hash */
+            memset(buf + (n > 0 ? n : 0), 0, chunk->length - (n > 0 ? n : 0));
+        }
+        res = stream_write(&s, buf, chunk->length);
+    }
+    if (res > 0) res = stream_flush(&s);
+
+    free(buf);
+    free(list);
+    fclose(f);
+
+    if (res < 0) {
+        perror("[SERVER] Failed to send the chunks\n");
+        return -1;
+    }
+
+    return 1;
+}
 
-        } while (r->len == 5);
+/* tg <dir>: send the whole tree under dir in one stream */
+int execute_tg(char *argument, const codec *c)
+{
+    msg t;
+    int res;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
+
+    stream s;
+    stream_init(&s, c);
+    res = tree_send(&s, argument);
+    if (res < 0) {
+        perror("[SERVER] Failed to send the tree\n");
+        return -1;
     }
+    printf("[SERVER] Sent %d files of %s\n", res, argument);
 
     return 1;
 }
 
-int wait_until_correct_parity(msg* r, msg* t)
+/* tp <dir>: receive a tree from the client into new_<dir> */
+int execute_tp(char *argument, const codec *c)
 {
+    msg t;
     int res;
 
-    do {
-        /* Send NACK */
-        sprintf(t->payload, NACK);
-        t->len = strlen(t->payload) + 1;
-        res = send_message(t);
-        if (res < 0) {
-            perror("[SERVER] Send NACK error. Exiting.\n");
-            return -1;
-        } else {
-        }
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
 
-        /* Receive again the package */
-        res = recv_message(r);
-        if (res < 0) {
-            perror("[SERVER] Receive error. Exiting\n");
-            return -1;
-        }
+    char root[256];
+    snprintf(root, sizeof(root), "new_%s", argument);
 
-    } while (!is_parity_correct(*r));
+    stream s;
+    stream_init(&s, c);
+    res = tree_receive(&s, root);
+    if (res < 0) {
+        perror("[SERVER] Failed to receive the tree\n");
+        return -1;
+    }
+    printf("[SERVER] Received %d files into %s\n", res, root);
 
     return 1;
 }
 
-int detect_correct_errors_and_decode(msg* r)
+/* Open a file of a batch ahead of its turn and have the kernel start
+   reading it while the one before is still going out */
+FILE *prefetch(const char *path)
 {
-    int i, error;
-    char decoded_message[r->len / 2];
-
-    /* Detect error in case we have one */
-    /* Take each and every chunk of 2 bytes and apply hamming algorithm on it */
-    int chunk;
-    int control_bit0, control_bit1, control_bit2, control_bit3;
-    for (chunk = 0; chunk < r->len; chunk += 2) {
-
-        /* Detect error on the current chunk of 2 bytes -> r->payload[chunk] and r->payload[chunk + 1] */
-        control_bit0 = control_bit1 = control_bit2 = control_bit3 = 0;
+    FILE *f = fopen(path, "r");
+    if (f != NULL) posix_fadvise(fileno(f), 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
 
-        /* Compute control_bit0 */ 
-        for (i = 0; i < first_c0_in_byte_2; i++) {
-            control_bit0 += get_bit(r->payload[chunk], c0_bit[i]);
-        }
-        for (i = first_c0_in_byte_2; i < 6; i++) {
-            control_bit0 += get_bit(r->payload[chunk + 1], c0_bit[i]);
-        }
-
-        /* Compute control_bit1 */
-        for (i = 0; i < first_c1_in_byte_2; i++) {
-            control_bit1 += get_bit(r->payload[chunk], c1_bit[i]);
-        }
-        for (i = first_c1_in_byte_2; i < 6; i++) {
-            control_bit1 += get_bit(r->payload[chunk + 1], c1_bit[i]);
-        }
+    return f;
+}
 
-        /* Compute control_bit2 */
-        for (i = 0; i < first_c2_in_byte_2; i++) {
-            control_bit2 += get_bit(r->payload[chunk], c2_bit[i]);
-        }
-        for (i = first_c2_in_byte_2; i < 5; i++) {
-            control_bit2 += get_bit(r->payload[chunk + 1], c2_bit[i]);
-        }
+/* mg <pattern>: send every file matching the glob pattern, in order,
+   as the file records of one stream (see tree.h) */
+int execute_mg(char *argument, const codec *c)
+{
+    msg t;
+    int res;
+    glob_t matches;
 
-        /* Compute control_bit3 */
-        for (i = first_c3_in_byte_2; i < 5; i++) {
-            control_bit3 += get_bit(r->payload[chunk + 1], c3_bit[i]);
-        }
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
 
-        /* Check if we actually have an error or not */
-        control_bit0 %= 2; control_bit1 %= 2;
-        control_bit2 %= 2; control_bit3 %= 2;
-
-        error = control_bit0; 
-        if (control_bit1) error += control_bit1 << 1;
-        if (control_bit2) error += control_bit2 << 2;
-        if (control_bit3) error += control_bit3 << 3;
-        /* If needed, correct the error */
-        if (error) {
-            /* Correct the first byte */
-            if (error <= 4) { r->payload[chunk] ^= (1 << (4 - error)); }
-            /* Correct the second byte */
-            else if (error > 4 && error <= 12) { r->payload[chunk + 1] ^= (1 << (12 - error)); }
+    /* No match is an empty batch */
+    if (glob(argument, 0, NULL, &matches) != 0) matches.gl_pathc = 0;
+
+    stream s;
+    stream_init(&s, c);
+    int i, files = 0;
+    FILE *next = matches.gl_pathc ? prefetch(matches.gl_pathv[0]) : NULL;
+    for (i = 0, res = 1; i < matches.gl_pathc && res >= 0; i++) {
+        FILE *f = next;
+        next = i + 1 < matches.gl_pathc ? prefetch(matches.gl_pathv[i + 1]) : NULL;
+        if (f == NULL) {
+            printf("[SERVER] Skipping %s, cannot open it\n", matches.gl_pathv[i]);
+            continue;
         }
 
-        /* Decode the bytes */
-        int bit_value;
-        for (i = 0; i < first_data_in_byte_2; i++) {
-            bit_value = get_bit(r->payload[chunk], data_bits[i]);
-            if (bit_value) decoded_message[chunk / 2] |= (1 << (8 - i - 1));
-            else decoded_message[chunk / 2] &= ~(1 << (8 - i - 1));
-        }
-        for (i = first_data_in_byte_2; i < 8; i++) {
-            bit_value = get_bit(r->payload[chunk + 1], data_bits[i]);
-            if (bit_value) decoded_message[chunk / 2] |= (1 << (8 - i - 1));
-            else decoded_message[chunk / 2] &= ~(1 << (8 - i - 1));
-        }
+        res = tree_send_file(&s, f, matches.gl_pathv[i]);
+        files += res > 0;
+        fclose(f);
     }
+    if (next) fclose(next);
+    if (res >= 0) res = tree_send_end(&s);
+    globfree(&matches);
 
-    /* Set the new length and memcpy in r->payload the decoded message */
-    r->len /= 2;
-    memcpy(r->payload, decoded_message, r->len);
+    if (res < 0) {
+        perror("[SERVER] Failed to send the batch\n");
+        return -1;
+    }
+    printf("[SERVER] Sent %d files matching %s\n", files, argument);
 
     return 1;
 }
 
-int encode(msg* t)
+/* hs <name>: "<size> <mtime> <hash>" of a file (see digest.h), or "-1"
+   if there is no such file, so that clients skip unchanged files
+   without fetching them */
+int execute_hs(char *argument, const codec *c)
 {
-    char encoded_message[t->len * 2];
-    int i, chunk, bit_value, j;
-    int control_bit0, control_bit1, control_bit2, control_bit3;
-    char byte1, byte2;
-
-    /* Take each byte and encode it using hamming coding method */
-    /* At the end, 1 byte becomes 2 bytes */
-    for (chunk = 0, j = 0; chunk < t->len; chunk++, j += 2) {
-        
-        /* Init byte1 and byte2 */
-        for (i = 0; i < 8; i++) {
-            byte1 &= ~(1 << i);
-            byte2 &= ~(1 << i);
-        }
-
-        /* Fill the 2nd byte with data bits */
-        for (i = 0; i < 4; i++) {
-            bit_value = get_bit(t->payload[chunk], i);
-            if (bit_value) byte2 |= (1 << i);
-            else byte2 &= ~(1 << i);
-        }
-        for (i = 4; i < 7; i++) {
-            bit_value = get_bit(t->payload[chunk], i);
-            if (bit_value) byte2 |= (1 << (i + 1));
-            else byte2 &= ~(1 << (i + 1));
-        }
-
-        /* Fill the 1st byte with data bits */
-        bit_value = get_bit(t->payload[chunk], 7);
-        if (bit_value) byte1 |= (1 << 1);
-        else byte1 &= ~(1 << 1);
+    msg t;
+    int res;
 
-        /* Calculate control bits and insert them into bytes1 and byte2 */
-        control_bit0 = control_bit1 = control_bit2 = control_bit3 = 0;
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
+    }
 
-        /* Compute control_bit0 */ 
-        for (i = 0; i < first_c0_in_byte_2; i++) {
-            control_bit0 += get_bit(byte1, c0_bit[i]);
-        }
-        for (i = first_c0_in_byte_2; i < 6; i++) {
-            control_bit0 += get_bit(byte2, c0_bit[i]);
-        }
+    char answer[64] = "-1";
+    const file_digest *d = digest_lookup(argument);
+    if (d != NULL)
+        sprintf(answer, "%lld %lld %016llx", d->size, (long long)d->mtime, (unsigned long long)d->hash);
+    put_string(c, &t, answer);
 
-        /* Compute control_bit1 */
-        for (i = 0; i < first_c1_in_byte_2; i++) {
-            control_bit1 += get_bit(byte1, c1_bit[i]);
-        }
-        for (i = first_c1_in_byte_2; i < 6; i++) {
-            control_bit1 += get_bit(byte2, c1_bit[i]);
-        }
+    res = send_confirmed(c, &t);
+    if (res < 0) {
+        perror("[SERVER] Error while sending the digest\n");
+        return -1;
+    }
 
-        /* Compute control_bit2 */
-        for (i = 0; i < first_c2_in_byte_2; i++) {
-            control_bit2 += get_bit(byte1, c2_bit[i]);
-        }
-        for (i = first_c2_in_byte_2; i < 5; i++) {
-            control_bit2 += get_bit(byte2, c2_bit[i]);
-        }
+    return d != NULL ? 1 : -1;
+}
 
-        /* Compute control_bit3 */
-        for (i = first_c3_in_byte_2; i < 5; i++) {
-            control_bit3 += get_bit(byte2, c3_bit[i]);
+/* Wait up to timeout ms for the followed file, open as fd, to change.
+   Returns 1 if it did, 0 if not. *rotated is set when the file was
+   moved or deleted, so that the name has to be opened again. */
+int wait_for_change(int watch, int fd, int timeout, int *rotated)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { watch, POLLIN, 0 };
+    struct stat st;
+    int n, changed = 0;
+
+    if (poll(&pfd, 1, timeout) > 0) {
+        while ((n = read(watch, events, sizeof(events))) > 0) {
+            char *p;
+            for (p = events; p < events + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+                struct inotify_event *e = (struct inotify_event *)p;
+                if (e->mask & IN_MOVE_SELF) *rotated = 1;
+                changed = 1;
+            }
         }
-
-        control_bit0 %= 2; control_bit1 %= 2;
-        control_bit2 %= 2; control_bit3 %= 2;
-
-        if (control_bit0) byte1 |= (1 << 3);
-        else byte1 &= ~(1 << 3);
-
-        if (control_bit1) byte1 |= (1 << 2);
-        else byte1 &= ~(1 << 2);
-
-        if (control_bit2) byte1 |= (1 << 0);
-        else byte1 &= ~(1 << 0);
-
-        if (control_bit3) byte2 |= (1 << 4);
-        else byte2 &= ~(1 << 4);
-
-        encoded_message[chunk * 2] = byte1; encoded_message[chunk * 2 + 1] = byte2;
     }
 
-    /* Set the new length and memcpy the encoded message */
-    t->len = t->len * 2;
-    memcpy(t->payload, encoded_message, t->len);
+    /* IN_DELETE_SELF waits for our own descriptor to close, a deleted
+       file only shows as having no links left */
+    if (fstat(fd, &st) == 0 && st.st_nlink == 0) {
+        *rotated = 1;
+        changed = 1;
+    }
 
-    return 1;
+    return changed;
 }
 
-int execute_ls(char *argument, int mode)
+/* fl <name> [offset]: follow a growing file, like tail -f. Whenever the
+   file grows, the server sends a package "<offset> <length>" and then
+   the new bytes as cp chunks; when nothing happens for FOLLOW_IDLE ms
+   it sends "<offset> 0". The client answers these with ACK to go on
+   or BYE to stop after them. A truncated or rotated file starts over
+   from offset 0, so the offset tells the client where the bytes go
+   and where to resume from in a later session. */
+int execute_fl(char *argument, const codec *c)
 {
     msg t, r;
     int res;
+    char name[256];
+    long long offset = 0;
 
-    /* Send confirmation for been receiving the command */
-    sprintf(t.payload, ACK);
-    if (mode == HAMMING) t.len = strlen(t.payload);
-    else t.len = strlen(t.payload) + 1;
-    res = send_message(&t);
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
     if (res < 0) {
         perror("[SERVER] Send ACK error. Exiting.\n");
         return -1;
-    }  
+    }
 
-    DIR *dir;
-    struct dirent *file_s;
+    if (sscanf(argument, "%255s %lld", name, &offset) < 1 || offset < 0) {
+        printf("[SERVER] Bad follow request %s\n", argument);
+        return -1;
+    }
 
-    /* Open directory */
-    if ((dir = opendir(argument)) == NULL) {
-        perror("[SERVER] Cannot open file\n");
+    int watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch < 0) {
+        perror("[SERVER] Cannot watch files\n");
         return -1;
     }
 
-    /* Start reading the dir and counting files */
-    int number_of_files = 0;
-    do {
-        errno = 0;
-        if ((file_s = readdir(dir)) != NULL) {
-            number_of_files++;
+    FILE *f = NULL;
+    int wd = -1, rotated = 0, stop = 0;
+    char head[48];
+    while (res >= 0 && !stop) {
+        /* Open the file, again after a rotation. It may not exist yet. */
+        if (f == NULL) {
+            f = fopen(name, "r");
+            if (f != NULL)
+                wd = inotify_add_watch(watch, name, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                                    IN_MOVE_SELF);
         }
-    } while (file_s != NULL);
 
-    if (errno != 0) {
-        perror("[SERVER] Error while reading the dir\n");
-        return -1;
-    }
+        struct stat st;
+        long long size = offset;
+        if (f != NULL && fstat(fileno(f), &st) == 0) size = st.st_size;
+        if (size < offset) {
+            /* Truncated in place */
+            offset = 0;
+        }
 
-    /* Send a package containing the number of files found in the argument dir */
-    if (mode == PARITY) {
-        sprintf(t.payload + 1, "%d", number_of_files);
-        t.len = strlen(t.payload);
-        /* Get the parity of bytes starting with byte 1 */
-        int parity = get_parity(t.payload, 1, t.len);
-        /* Set the parity on the rightmost bit on the 0 byte */
-        set_parity(t.payload, 0, parity);
-    } else if (mode == NORMAL) {
-        sprintf(t.payload, "%d", number_of_files);
-        t.len = strlen(t.payload) + 1; 
-    } else if (mode == HAMMING) {
-        sprintf(t.payload, "%d", number_of_files);
-        t.len = strlen(t.payload);
-        encode(&t);
-    }
+        if (size > offset) {
+            /* Send what was appended, then wait for more */
+            sprintf(head, "%lld %lld", offset, size - offset);
+            put_string(c, &t, head);
+            res = send_range_after(c, fileno(f), offset, size - offset, &t, &r);
+            offset = size;
+        } else if (rotated) {
+            /* The old file is drained, go on with the new one */
+            inotify_rm_watch(watch, wd);
+            fclose(f);
+            f = NULL;
+            offset = 0;
+            rotated = 0;
+            continue;
+        } else if (f != NULL && wait_for_change(watch, fileno(f), FOLLOW_IDLE, &rotated)) {
+            continue;
+        } else {
+            /* Nothing new, let the client know we are still here */
+            if (f == NULL) usleep(FOLLOW_IDLE * 1000);
+            sprintf(head, "%lld 0", offset);
+            put_string(c, &t, head);
+            res = send_answered(c, &t, &r);
+        }
 
-    res = send_message(&t);
-    if (res < 0) {
-        perror("[SERVER] Send number of files found error\n");
-        return -1;
+        /* r holds an answer only if the client gave one */
+        if (res > 0) stop = !strncmp(r.payload, BYE, strlen(BYE));
     }
 
-    /* Receive confirmation for receiving number_of_files */
-    res = recv_message(&r);
+    if (f != NULL) fclose(f);
+    close(watch);
+
     if (res < 0) {
-        perror("[SERVER] Error, confirmation for nb_of_files not received\n");
+        perror("[SERVER] Failed to follow the file\n");
         return -1;
-    } else {
-        // printf("[SERVER] Received %s from client\n", r.payload);
-        if (mode == PARITY) {
-            /* In case the client sended NACK, send the package over and over again */
-            wait_until_ack(&r, &t);
-        }
     }
 
-    /* Walk through the directory again and send files names */
-    rewinddir(dir);
-    do {
-        if ((file_s = readdir(dir)) != NULL) {
-            
-            /* Send current file name */
-            if (mode == PARITY) {
-                sprintf(t.payload + 1, file_s->d_name);
-                t.len = strlen(file_s->d_name) + 1;
-                /* Get the parity of bytes starting with byte 1 */
-                int parity = get_parity(t.payload, 1, t.len);
-                /* Set the parity on the rightmost bit on the 0 byte */
-                set_parity(t.payload, 0, parity);
-            } else if (mode == NORMAL || mode == HAMMING) {
-                sprintf(t.payload, file_s->d_name);
-                t.len = strlen(t.payload);
-            }
-
-            if (mode == HAMMING) encode(&t);
-
-            res = send_message(&t);
-            if (res < 0) {
-                perror("[SERVER] Error while sending current filename\n");
-                return -1;
-            }
+    return 1;
+}
 
-            /* Receive confirmation for the last file sent */
-            res = recv_message(&r);
-            if (res < 0) {
-                perror("[SERVER] Error while receiving confirmation\n");
-                return -1;
-            } else {
-                if (mode == PARITY) {
-                    /* In case the client sended NACK, send the package over and over again */
-                    wait_until_ack(&r, &t);
-                }
-            }
-        }
-    } while (file_s != NULL);
+/* The probe number a client's answer "ACK <seq>" or "NACK <seq>" of
+   bytes bytes echoes, or -1 if it has none */
+int probe_answer(msg *r, int bytes)
+{
+    char word[8];
+    int seq, n = bytes - (int)offsetof(msg, payload);
 
-    closedir(dir);
+    if (n < 0) return -1;
+    if (n > MAX_MSGSIZE - 1) n = MAX_MSGSIZE - 1;
+    r->payload[n] = '\0';
+    if (sscanf(r->payload, "%7s %d", word, &seq) < 2) return -1;
 
-    return 1;
+    return seq;
 }
 
-int execute_cd(char *argument) 
+/* Send one package "<size> <seq>" of size bytes. Returns 1 if the
+   client answered it (ACK or NACK with the same seq, either way it got
+   through), 0 if it never did. Answers that come late for an earlier
+   probe carry another seq and are skipped. */
+int probe_size(const codec *c, int size)
 {
-    msg t;
-    int res;
+    static int seq = 0;
+    msg t, r;
+    char probe[32];
+    int try, res;
 
-    /* Send confirmation for receiving the command */
-    sprintf(t.payload, ACK);
-    t.len = strlen(t.payload) + 1;
-    res = send_message(&t);
-    if (res < 0) {
-        perror("[SERVER] Send ACK error. Exiting.\n");
-        return -1;
-    }
+    set_msgsize(size);
+    sprintf(probe, "%d %d", size, ++seq);
+    put_string(c, &t, probe);
 
-    int ret = chdir(argument);
-    if (ret < 0) {
-        perror("[SERVER] Failed to change dir");
-        return -1;
+    for (try = 0; try < PROBE_TRIES; try++) {
+        res = send_message(&t);
+        if (res < 0) return -1;
+
+        while ((res = recv_message_timeout(&r, PROBE_TIMEOUT)) > 0)
+            if (probe_answer(&r, res) == seq) return 1;
+        if (res < 0) return -1;
     }
 
-    return 1;
+    return 0;
 }
 
-int execute_cp(char *argument, int mode) 
+/* sz <size>: find the largest datagram size up to size that gets
+   through. The server sends probes "<size> <seq>", each answered by
+   the client with "ACK <seq>" (or "NACK <seq>" if it came damaged),
+   then the agreed "<size>" in a package of the old size, confirmed as
+   usual. Both switch to it after that. */
+int execute_sz(char *argument, const codec *c)
 {
     msg t, r;
     int res;
 
     /* Send confirmation for receiving the command */
-    sprintf(t.payload, ACK);
-    t.len = strlen(ACK) + 1;
-    res = send_message(&t);
+    res = send_ack(&t);
     if (res < 0) {
         perror("[SERVER] Send ACK error. Exiting.\n");
         return -1;
     }
 
-    /* Open the file received as a parameter */
-    FILE* f = fopen(argument, "r");
-
-    /* Determine the length of the file */
-    fseek(f, 0L, SEEK_END);
-    int file_length = ftell(f);
-    fseek(f, 0L, SEEK_SET);
-
-    /* Send a package containing the length of the file */
-    if (mode == PARITY) {
-        sprintf(t.payload + 1, "%d", file_length);
-        t.len = strlen(t.payload);
-        /* Get the parity of bytes starting with byte 1 */
-        int parity = get_parity(t.payload, 1, t.len);
-        /* Set the parity on the rightmost bit on the 0 byte */
-        set_parity(t.payload, 0, parity);
-    } else if (mode == NORMAL || mode == HAMMING) {
-        sprintf(t.payload, "%d", file_length);
-        t.len = strlen(t.payload);
-        if (mode == HAMMING) encode(&t);
+    int current = get_msgsize();
+    int wanted = atoi(argument);
+    if (wanted < MIN_MSGSIZE) wanted = MIN_MSGSIZE;
+    if (wanted > MAX_MSGSIZE) wanted = MAX_MSGSIZE;
+
+    /* Find the largest size up to the wanted one that the path delivers.
+       Packages of the current size are known to get through. Probes
+       prove a size only if they are that size, trimmed or not. */
+    int good = current, bad, trimmed = get_trim();
+    set_trim(0);
+    if (wanted <= current) {
+        good = wanted;
+    } else {
+        res = probe_size(c, wanted);
+        if (res > 0) {
+            good = wanted;
+        } else if (res == 0) {
+            bad = wanted;
+            while (res >= 0 && bad - good > PROBE_STEP) {
+                int size = (good + bad) / 2;
+                res = probe_size(c, size);
+                if (res > 0) good = size;
+                else if (res == 0) bad = size;
+            }
+        }
     }
-    
-    res = send_message(&t);
+
+    set_msgsize(current);
+    set_trim(trimmed);
     if (res < 0) {
-        perror("[SERVER] Error while sending file length. Exiting.\n");
+        perror("[SERVER] Error while probing the datagram size\n");
         return -1;
     }
 
-    /* Wait for the confirmation that file_length was receieved */
-    res = recv_message(&r);
+    /* Tell the client the agreed size, then both switch to it. Answers
+       to probes that timed out may still come in before the client's
+       confirmation, they carry a seq and are drained. */
+    char size[16];
+    sprintf(size, "%d", good);
+    put_string(c, &t, size);
+
+    res = send_message(&t);
+    while (res >= 0 && (res = recv_message(&r)) >= 0 && probe_answer(&r, res) >= 0)
+        ;
+    if (res >= 0) res = c->confirm(&r, &t);
     if (res < 0) {
-        perror("[SERVER] Error while receiving confirmation\n");
+        perror("[SERVER] Error while sending the datagram size\n");
         return -1;
-    } else {
-        if (mode == PARITY) wait_until_ack(&r, &t);
-    }
-
-    /* Start sending pieces of data from the file.
-       Each and every package should be <= 1400 bytes in size */
-    int number_of_packages;
-    if (mode == PARITY) {
-        number_of_packages = file_length / (MSGSIZE - 1);
-        if (file_length % (MSGSIZE - 1)) number_of_packages++;
-    } else if (mode == NORMAL) {
-        number_of_packages = file_length / MSGSIZE;
-        if (file_length % MSGSIZE) number_of_packages++;
-    } else if (mode == HAMMING) {
-        number_of_packages = file_length / (MSGSIZE / 2);
-        if (file_length % (MSGSIZE / 2)) number_of_packages++;
-    }
-    
-    int package, objects_read;
-    for (package = 1; package <= number_of_packages; package++) {
-        /* Read the chunk of data */
-        if (mode == PARITY) {
-            objects_read = fread(t.payload + 1, sizeof(char), MSGSIZE - 1, f);
-            t.len = objects_read + 1;
-            /* Get the parity of bytes starting with byte 1 */
-            int parity = get_parity(t.payload, 1, t.len);
-            /* Set the parity on the rightmost bit on the 0 byte */
-            set_parity(t.payload, 0, parity);
-        } else if (mode == NORMAL) {
-            objects_read = fread(t.payload, sizeof(char), MSGSIZE, f);
-            t.len = objects_read;
-        } else if (mode == HAMMING) {
-            objects_read = fread(t.payload, sizeof(char), MSGSIZE / 2, f);
-            t.len = objects_read;
-            encode(&t);
-        }
-
-        res = send_message(&t);
-
-        if (res < 0) {
-            perror("[SERVER] Failed to send one chunk of data\n");
-            return -1;
-        }
-
-        /* Wait for the confirmation that chunk of data was received by the client*/
-        res = recv_message(&r);
-        if (res < 0) {
-            perror("[SERVER] Error while receiving confirmation\n");
-            return -1;
-        } else {
-            // printf("[SERVER] Received %s from client\n", r.payload);
-            if (mode == PARITY) wait_until_ack(&r, &t);
-        }
     }
 
-    /* Close the file */
-    fclose(f);
+    set_msgsize(good);
+    printf("[SERVER] Datagram size is now %d\n", good);
 
     return 1;
 }
 
-int execute_sn(char* argument, int mode) 
+int execute_at(char *argument)
 {
-    msg t, r;
+    msg t;
     int res;
 
     /* Send confirmation for receiving the command */
-    sprintf(t.payload, ACK);
-    t.len = strlen(ACK) + 1;
-    res = send_message(&t);
+    res = send_ack(&t);
     if (res < 0) {
         perror("[SERVER] Send ACK error. Exiting.\n");
         return -1;
     }
 
-    /* Create the file sent as an argument */
-    char filename[256];
-    strcpy(filename, "new_");
-    strcat(filename, argument);
-    FILE* f = fopen(filename, "w");
+    /* Packages shrink with the tuned chunks, so datagrams have to as well */
+    int on = atoi(argument) != 0;
+    tune_enable(on);
+    set_trim(on);
 
-    /* Receive the package with the data length to write in the file */
-    res = recv_message(&r);
-    if (res < 0) {
-        perror("[SERVER] Receive length of file to write error\n");
-        return -1;
-    } else {
-        if (mode == PARITY) {
-            /* While the received package has not the right parity, we take care of that */
-            if (!is_parity_correct(r)) {
-                wait_until_correct_parity(&r, &t);
-            }
-        } else if (mode == HAMMING) {
-            detect_correct_errors_and_decode(&r);
-        }
-    }
+    return 1;
+}
 
-    int c;
-    int file_length = 0;
-    if (mode == PARITY) {
-        for (c = 1; c < r.len - 1; c++) {
-            file_length = file_length * 10 + (r.payload[c] - '0');
-        }
-    } else if (mode == NORMAL || mode == HAMMING) {
-        for (c = 0; c < r.len - 1; c++) {
-            file_length = file_length * 10 + (r.payload[c] - '0');
-        }
-    }
+int execute_cz(char *argument)
+{
+    msg t;
+    int res;
 
-    /* Send confirmation for receiving the file_length */
-    sprintf(t.payload, ACK);
-    t.len = strlen(ACK) + 1;
-    res = send_message(&t);
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
     if (res < 0) {
         perror("[SERVER] Send ACK error. Exiting.\n");
         return -1;
     }
 
-    /* Receive chunks of data and write them into the new created file */
-    int number_of_packages;
-    if (mode == PARITY) {
-        number_of_packages = file_length / (MSGSIZE - 1);
-        if (file_length % (MSGSIZE - 1)) number_of_packages++;   
-    } else if (mode == NORMAL) {
-        number_of_packages = file_length / MSGSIZE;
-        if (file_length % MSGSIZE) number_of_packages++;   
-    } else if (mode == HAMMING) {
-        number_of_packages = file_length / (MSGSIZE / 2);
-        if (file_length % (MSGSIZE / 2)) number_of_packages++; 
-    }
-         
-    int package;
-    for (package = 1; package <= number_of_packages; package++) {
-        res = recv_message(&r);
-        if (res < 0) {
-            perror("[SERVER] Error while receiving chunk of data\n");
-            return -1;
-        } else {
-            if (mode == PARITY) {
-                /* While the received package has not the right parity, we take care of that */
-                if (!is_parity_correct(r)) {                    
-                    wait_until_correct_parity(&r, &t);
-                }
-            } else if (mode == HAMMING) detect_correct_errors_and_decode(&r);
-        }
+    compression = atoi(argument) != 0;
 
-        /* Effectively write the data in the file */
-        int objects_written;
-        if (mode == PARITY) objects_written = fwrite(r.payload + 1, sizeof(char), r.len - 1, f);
-        else if (mode == NORMAL || mode == HAMMING) {
-            objects_written = fwrite(r.payload, sizeof(char), r.len, f);
-        }
+    return 1;
+}
 
-        /* Consider the two possible cases */
-        if (mode == PARITY && objects_written == r.len - 1) {
-            /* Send confirmation that data was written successfully */
-            sprintf(t.payload, ACK);
-            t.len = strlen(ACK) + 1;
-            res = send_message(&t);
-            if (res < 0) {
-                perror("[SERVER] Send ACK error. Exiting.\n");
-                return -1;
-            }
-        } else if ((mode == NORMAL && objects_written == r.len) || 
-                (mode == HAMMING && objects_written == r.len)) {
-            /* Send confirmation that data was written successfully */
-            sprintf(t.payload, ACK);
-            t.len = strlen(ACK);
-            res = send_message(&t);
-            if (res < 0) {
-                perror("[SERVER] Send ACK error. Exiting.\n");
-                return -1;
-            }
-        } else {
-            printf("[SERVER] Failed to write entire chunk %d of data in the file\n", package);
-        }
+/* pc <0|1>: pace what the server sends to the link's bottleneck, off by
+   default */
+int execute_pc(char *argument)
+{
+    msg t;
+    int res;
+
+    /* Send confirmation for receiving the command */
+    res = send_ack(&t);
+    if (res < 0) {
+        perror("[SERVER] Send ACK error. Exiting.\n");
+        return -1;
     }
 
-    /* Close the file */
-    fclose(f);
+    pace_enable(atoi(argument) != 0);
 
     return 1;
 }
 
-int execute_exit(char *argument, int mode)
+int execute_exit(char *argument)
 {
     msg t;
     int res;
 
     /* Send confirmation for received the command */
-    sprintf(t.payload, ACK);
-    if (mode == PARITY) t.len = strlen(t.payload) + 1;
-    else if (mode == NORMAL || HAMMING) t.len = strlen(t.payload);
-    res = send_message(&t);
+    res = send_ack(&t);
     if (res < 0) {
         perror("[SERVER] Send ACK error. Exiting.\n");
         return -1;
@@ -714,7 +1626,7 @@ int execute_exit(char *argument, int mode)
     return 1;
 }
 
-int running_mode(int mode)
+int running_mode(const codec *c)
 {
     msg r, t;
     int res;
@@ -725,18 +1637,11 @@ int running_mode(int mode)
 
         /* Receive a package from client */
         res = recv_message(&r);
-        if (res < 0) {
+        if (res < 0 || c->open(&r, &t) < 0) {
             perror("[SERVER] Receive error. Exiting\n");
             return -1;
         }
 
-        if (mode == PARITY) {
-            /* While the received package has not the right parity, we take care of that */
-            if (!is_parity_correct(r)) wait_until_correct_parity(&r, &t);
-        } else if (mode == HAMMING) {
-            detect_correct_errors_and_decode(&r);
-        }
-
         /* Split package that contains client's want */
         char* command;
         char* argument;
@@ -744,17 +1649,16 @@ int running_mode(int mode)
         char* separator = " ";
 
         /* Get the command */
-        if (mode == PARITY) token = strtok(r.payload + 1, separator);
-        else if (mode == NORMAL || mode == HAMMING) token = strtok(r.payload, separator);
+        token = strtok(codec_data(c, &r), separator);
         command = strdup(token);
 
-        /* Get the argument */
-        token = strtok(NULL, separator);
-        argument = strdup(token);
+        /* Get the argument, all the rest of the line */
+        token = strtok(NULL, "");
+        argument = strdup(token ? token : "");
 
         /* Figure out the type of command */
         if (!strcmp(LS, command)) {
-            if (!execute_ls(argument, mode)) {
+            if (!execute_ls(argument, c)) {
                 printf("[SERVER] Command LS executed unsuccessufully\n");
             }
         } else if (!strcmp(CD, command)) {
@@ -762,15 +1666,67 @@ int running_mode(int mode)
                 printf("[SERVER] Command CD executed unsuccessufully\n");
             }
         } else if (!strcmp(CP, command)) {
-            if (!execute_cp(argument, mode)) {
+            if (!execute_cp(argument, c)) {
                 printf("[SERVER] Command CP executed unsuccessufully\n");
             }
         } else if (!strcmp(SN, command)) {
-            if (!execute_sn(argument, mode)) {
+            if (!execute_sn(argument, c)) {
                 printf("[SERVER] Command SN executed unsuccessufully\n");
             }
+        } else if (!strcmp(SZ, command)) {
+            if (!execute_sz(argument, c)) {
+                printf("[SERVER] Command SZ executed unsuccessufully\n");
+            }
+        } else if (!strcmp(AT, command)) {
+            if (!execute_at(argument)) {
+                printf("[SERVER] Command AT executed unsuccessufully\n");
+            }
+        } else if (!strcmp(CZ, command)) {
+            if (!execute_cz(argument)) {
+                printf("[SERVER] Command CZ executed unsuccessufully\n");
+            }
+        } else if (!strcmp(DS, command)) {
+            if (!execute_ds(argument, c)) {
+                printf("[SERVER] Command DS executed unsuccessufully\n");
+            }
+        } else if (!strcmp(DG, command)) {
+            if (!execute_dg(argument, c)) {
+                printf("[SERVER] Command DG executed unsuccessufully\n");
+            }
+        } else if (!strcmp(CR, command)) {
+            if (!execute_cr(argument, c)) {
+                printf("[SERVER] Command CR executed unsuccessufully\n");
+            }
+        } else if (!strcmp(PR, command)) {
+            if (!execute_pr(argument, c)) {
+                printf("[SERVER] Command PR executed unsuccessufully\n");
+            }
+        } else if (!strcmp(TG, command)) {
+            if (!execute_tg(argument, c)) {
+                printf("[SERVER] Command TG executed unsuccessufully\n");
+            }
+        } else if (!strcmp(TP, command)) {
+            if (!execute_tp(argument, c)) {
+                printf("[SERVER] Command TP executed unsuccessufully\n");
+            }
+        } else if (!strcmp(MG, command)) {
+            if (!execute_mg(argument, c)) {
+                printf("[SERVER] Command MG executed unsuccessufully\n");
+            }
+        } else if (!strcmp(HS, command)) {
+            if (!execute_hs(argument, c)) {
+                printf("[SERVER] Command HS executed unsuccessufully\n");
+            }
+        } else if (!strcmp(FL, command)) {
+            if (!execute_fl(argument, c)) {
+                printf("[SERVER] Command FL executed unsuccessufully\n");
+            }
+        } else if (!strcmp(PC, command)) {
+            if (!execute_pc(argument)) {
+                printf("[SERVER] Command PC executed unsuccessufully\n");
+            }
         } else if (!strcmp(EXIT, command)) {
-            if (!execute_exit(argument, mode)) {
+            if (!execute_exit(argument)) {
                 printf("[SERVER] Command EXIT executed unsuccessufully\n");
             }
             current_state = -1;
@@ -778,6 +1734,9 @@ int running_mode(int mode)
             printf("[SERVER] Received unknown command. Exiting.\n");
             current_state = -1;
         }
+
+        free(command);
+        free(argument);
     }
 
     return EXITED_NORMALLY;
@@ -785,24 +1744,24 @@ int running_mode(int mode)
 }
 
 int main(int argc, char** argv)
-{    
+{
+    const codec *c = &normal_codec;
+
     printf("[RECEIVER] Starting.\n");
-    init(HOST, PORT);
+    if (argc > 2) host = argv[2];
+    init(host, PORT);
 
     // Determine running mode
     if (argc > 1) {
-        if (!strcmp(argv[1], RUN_PARITY_MODE)) {
-            running_mode(PARITY);
-        } else if (!strcmp(argv[1], RUN_HAMMING_MODE)) {
-            running_mode(HAMMING);
-        } else { 
+        c = find_codec(argv[1]);
+        if (c == NULL) {
             printf("[SERVER] Running unknown mode. Exiting.\n");
             return 0;
         }
-    } else {
-        running_mode(NORMAL);
     }
 
+    running_mode(c);
+
     printf("[RECEIVER] Finished receiving..\n");
 
     return 0;
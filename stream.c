@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include "stream.h"
+
+void stream_init(stream *s, const codec *c)
+{
+    s->c = c;
+    s->pos = 0;
+    s->len = 0;
+}
+
+int stream_write(stream *s, const void *buf, int n)
+{
+    const char *p = buf;
+    int capacity = s->c->capacity(get_msgsize());
+
+    while (n > 0) {
+        int k = capacity - s->pos < n ? capacity - s->pos : n;
+        memcpy(codec_data(s->c, &s->m) + s->pos, p, k);
+        s->pos += k;
+        p += k;
+        n -= k;
+
+        if (s->pos == capacity && stream_flush(s) < 0) return -1;
+    }
+
+    return 1;
+}
+
+int stream_flush(stream *s)
+{
+    if (s->pos == 0) return 1;
+
+    s->m.len = s->c->header + s->pos;
+    s->c->seal(&s->m);
+    s->pos = 0;
+
+    return send_confirmed(s->c, &s->m);
+}
+
+int stream_read(stream *s, void *buf, int n)
+{
+    char *p = buf;
+    msg t;
+
+    while (n > 0) {
+        if (s->pos == s->len) {
+            /* Drained, take the next package */
+            if (recv_opened(s->c, &s->m, &t) < 0) return -1;
+            if (send_ack(&t) < 0) return -1;
+            s->pos = 0;
+            s->len = codec_data_len(s->c, &s->m);
+            continue;
+        }
+
+        int k = s->len - s->pos < n ? s->len - s->pos : n;
+        memcpy(p, codec_data(s->c, &s->m) + s->pos, k);
+        s->pos += k;
+        p += k;
+        n -= k;
+    }
+
+    return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef STREAM
+#define STREAM
+
+#include "codec.h"
+
+/* A byte stream carried by confirmed packages, for transfers made of
+   many small records (signatures, deltas, file headers). The writer
+   packs records into full packages; the reader ACKs each package as
+   it drains it. */
+typedef struct {
+    const codec *c;
+    msg m;
+    /* Next data byte in m */
+    int pos;
+    /* Data bytes in m, when reading */
+    int len;
+} stream;
+
+void stream_init(stream *s, const codec *c);
+
+/* Returns 1, or -1 if the transfer broke */
+int stream_write(stream *s, const void *buf, int n);
+int stream_flush(stream *s);
+int stream_read(stream *s, void *buf, int n);
+
+#endif
@@ -0,0 +1,695 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "../lib.h"
+#include "../codec.h"
+#include "../lz.h"
+#include "../hash.h"
+#include "../stream.h"
+#include "../tree.h"
+#include "../digest.h"
+#include "../cdc.h"
+
+/* Test client, for every running mode and for the commands the prebuilt
+   client does not know. Like that one it runs the lines of commands and
+   writes what it got to client_output; files come in as new_<name> in
+   the current directory, files to send are taken from it. What it
+   prints does not depend on timing, so a run can be diffed against the
+   expected output. */
+
+#define HOST "127.0.0.1"
+#define PORT 10000
+
+/* Chunk framing while compression is on, as the server has it */
+#define CHUNK_RAW 0
+#define CHUNK_PACKED 1
+#define PACKED_HEADER (1 + sizeof(int))
+#define MAX_RAW_CHUNK (1 << 20)
+
+/* Delta upload instructions */
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_END 'E'
+
+/* fl: seconds to follow before saying BYE at the next quiet moment */
+#define FOLLOW_FOR 3
+
+#define MAX_FLOWS 16
+#define BYE "BYE"
+
+const codec *c = &normal_codec;
+FILE *output;
+char *me;
+
+/* 1 after cz 1, then chunks both ways are framed */
+int compression = 0;
+
+void say(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    fprintf(output, "[%s] ", me);
+    vfprintf(output, format, args);
+    fprintf(output, "\n");
+    fflush(output);
+    va_end(args);
+}
+
+/* Send a line of text and wait for its ACK */
+int send_line(const char *line)
+{
+    msg t;
+
+    strcpy(codec_data(c, &t), line);
+    t.len = c->header + strlen(line) + 1;
+    c->seal(&t);
+
+    return send_confirmed(c, &t);
+}
+
+/* Send a raw answer, as the server sends ACK and NACK */
+int send_raw(const char *text)
+{
+    msg t;
+
+    strcpy(t.payload, text);
+    t.len = strlen(text) + 1;
+
+    return send_message(&t);
+}
+
+/* Receive an answer the server sends as it is, ACK or NACK */
+int recv_raw(char *buf, int size)
+{
+    msg r;
+
+    if (recv_message(&r) < 0) return -1;
+    r.payload[size - 1 < r.len ? size - 1 : r.len] = '\0';
+    strcpy(buf, r.payload);
+
+    return strlen(buf);
+}
+
+/* Receive a package of text into buf (size bytes). A NACK from the
+   server comes as it is and is not confirmed. Returns the length, or
+   -1 if the transfer broke. */
+int recv_string_answered(char *buf, int size, int answer)
+{
+    msg r, t;
+
+    if (recv_message(&r) < 0) return -1;
+    if (r.len == strlen(NACK) + 1 && !strcmp(r.payload, NACK)) {
+        strcpy(buf, NACK);
+        return strlen(buf);
+    }
+    if (c->open(&r, &t) < 0) return -1;
+
+    int n = codec_data_len(c, &r);
+    if (n > size - 1) n = size - 1;
+    if (n < 0) n = 0;
+    memcpy(buf, codec_data(c, &r), n);
+    buf[n] = '\0';
+
+    if (answer && send_ack(&t) < 0) return -1;
+
+    return n;
+}
+
+int recv_string(char *buf, int size)
+{
+    return recv_string_answered(buf, size, 1);
+}
+
+/* Get the file bytes out of a received chunk, -1 if it is damaged */
+int unpack_chunk(char *data, int len, char **out)
+{
+    static __thread char raw[MAX_RAW_CHUNK];
+    int n;
+
+    *out = data;
+    if (!compression) return len;
+
+    if (len >= 1 && data[0] == CHUNK_RAW) {
+        *out = data + 1;
+        return len - 1;
+    }
+
+    if (len < PACKED_HEADER || data[0] != CHUNK_PACKED) return -1;
+    memcpy(&n, data + 1, sizeof(int));
+    if (n < 0 || n > MAX_RAW_CHUNK) return -1;
+    if (lz_decompress(data + PACKED_HEADER, len - PACKED_HEADER, raw, n) != n) return -1;
+
+    *out = raw;
+    return n;
+}
+
+/* Receive length bytes as chunks into fd from offset on */
+int recv_range(int fd, long long offset, long long length)
+{
+    msg r, t;
+    char *data;
+    int n;
+
+    while (length > 0) {
+        if (recv_opened(c, &r, &t) < 0) return -1;
+        n = unpack_chunk(codec_data(c, &r), codec_data_len(c, &r), &data);
+        if (n < 0) {
+            send_raw(NACK);
+            continue;
+        }
+        if (n > length) n = length;
+        if (pwrite(fd, data, n, offset) != n) return -1;
+        offset += n;
+        length -= n;
+        if (send_ack(&t) < 0) return -1;
+    }
+
+    return 1;
+}
+
+int open_new(const char *name, int truncate)
+{
+    char path[300];
+
+    snprintf(path, sizeof(path), "new_%s", name);
+    return open(path, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+}
+
+/* cp <name> and cr <name> <offset> <length> */
+int do_copy(char *command, char *line)
+{
+    char name[256], number[32];
+
+    sscanf(line, "%*s %255s", name);
+    if (send_line(line) < 0 || recv_string(number, sizeof(number)) < 0) return -1;
+
+    long long length = atoll(number);
+    say("receiving %s %lld", command, length);
+
+    int fd = open_new(name, 1);
+    if (fd < 0) return -1;
+    int res = recv_range(fd, 0, length);
+    close(fd);
+
+    return res;
+}
+
+/* One range of pr, on its own flow */
+typedef struct {
+    int flow;
+    int fd;
+    int msgsize;
+    long long offset;
+    int res;
+} flow_job;
+
+void *recv_flow(void *argument)
+{
+    flow_job *job = argument;
+    char number[32];
+
+    job->res = -1;
+    if (try_init(HOST, PORT + 2 * job->flow) < 0) return NULL;
+    set_msgsize(job->msgsize);
+
+    if (send_raw("ready") >= 0 && recv_string(number, sizeof(number)) >= 0)
+        job->res = recv_range(job->fd, job->offset, atoll(number));
+
+    finish();
+
+    return NULL;
+}
+
+int do_parallel(char *line)
+{
+    char name[256], answer[32];
+    flow_job jobs[MAX_FLOWS];
+    pthread_t threads[MAX_FLOWS];
+    long long length;
+    int used, flows = 0, i;
+
+    char *p = line;
+    sscanf(p, "%*s %255s%n", name, &used);
+    p += used;
+    while (flows < MAX_FLOWS && sscanf(p, "%lld %lld%n", &jobs[flows].offset, &length, &used) == 2) {
+        p += used;
+        flows++;
+    }
+
+    if (send_line(line) < 0 || recv_string(answer, sizeof(answer)) < 0) return -1;
+    if (!strcmp(answer, NACK)) {
+        say("pr refused");
+        return 1;
+    }
+    say("receiving pr on %s flows", answer);
+
+    int fd = open_new(name, 1);
+    if (fd < 0) return -1;
+    for (i = 0; i < flows; i++) {
+        jobs[i].flow = i + 1;
+        jobs[i].fd = fd;
+        jobs[i].msgsize = get_msgsize();
+        pthread_create(&threads[i], NULL, recv_flow, &jobs[i]);
+    }
+    for (i = 0; i < flows; i++) pthread_join(threads[i], NULL);
+    close(fd);
+
+    /* The server says whether every range went */
+    if (recv_raw(answer, sizeof(answer)) < 0) return -1;
+    say("pr %s", answer);
+
+    return 1;
+}
+
+/* sn <name> [policy]: the prebuilt client's upload, with the chunk size
+   the server asks for when autotuning is on */
+int do_send(char *line)
+{
+    char name[256], number[32];
+    msg t, r;
+
+    sscanf(line, "%*s %255s", name);
+    FILE *f = fopen(name, "r");
+    if (f == NULL) return -1;
+    fseek(f, 0L, SEEK_END);
+    long long length = ftell(f);
+    fseek(f, 0L, SEEK_SET);
+
+    if (send_line(line) < 0) {
+        fclose(f);
+        return -1;
+    }
+    sprintf(number, "%lld", length);
+    if (send_line(number) < 0) {
+        fclose(f);
+        return -1;
+    }
+    say("sending sn %lld", length);
+
+    char *raw = malloc(MAX_RAW_CHUNK);
+    int capacity = c->capacity(get_msgsize()), res = 1;
+    while (res > 0 && length > 0) {
+        char *data = codec_data(c, &t);
+        int n, len;
+
+        if (!compression) {
+            n = fread(data, 1, capacity, f);
+            len = n;
+        } else {
+            /* Pack what fills about the chunk, else send it as it is */
+            n = fread(raw, 1, 4 * capacity, f);
+            int packed = lz_compress(raw, n, data + PACKED_HEADER, capacity - PACKED_HEADER);
+            if (packed >= 0) {
+                data[0] = CHUNK_PACKED;
+                memcpy(data + 1, &n, sizeof(int));
+                len = PACKED_HEADER + packed;
+            } else {
+                fseek(f, -(long)n, SEEK_CUR);
+                n = fread(data + 1, 1, capacity - 1, f);
+                data[0] = CHUNK_RAW;
+                len = 1 + n;
+            }
+        }
+        if (n <= 0) break;
+
+        t.len = c->header + len;
+        c->seal(&t);
+        res = send_answered(c, &t, &r);
+        length -= n;
+
+        /* "ACK <size>" from the autotuning */
+        int tuned;
+        if (res > 0 && sscanf(r.payload, "ACK %d", &tuned) == 1 && tuned > 0) capacity = tuned;
+    }
+    free(raw);
+    fclose(f);
+    if (res <= 0 || length != 0) return -1;
+
+    /* Whether the server got it all on disk */
+    char answer[16];
+    if (recv_raw(answer, sizeof(answer)) < 0) return -1;
+    say("sn %s", answer);
+
+    return 1;
+}
+
+/* sz <size>: answer the probes, then take the size agreed on */
+int do_size(char *line)
+{
+    char text[64], word[16];
+    int size, seq;
+
+    if (send_line(line) < 0) return -1;
+
+    while (1) {
+        if (recv_string_answered(text, sizeof(text), 0) < 0) return -1;
+
+        if (sscanf(text, "%d %d", &size, &seq) == 2) {
+            sprintf(word, "ACK %d", seq);
+            send_raw(word);
+            continue;
+        }
+        if (send_raw(ACK) < 0) return -1;
+        size = atoi(text);
+        break;
+    }
+
+    set_msgsize(size);
+    say("sz %d", size);
+
+    return 1;
+}
+
+/* ds <name>: send the file as a delta against the server's copy. Blocks
+   equal to the basis block at the same place are copied, the rest goes
+   as literals. */
+int do_delta(char *line)
+{
+    char name[256], header[64];
+    int block, blocks, i;
+
+    sscanf(line, "%*s %255s", name);
+    FILE *f = fopen(name, "r");
+    if (f == NULL) return -1;
+
+    if (send_line(line) < 0 || recv_string(header, sizeof(header)) < 0) {
+        fclose(f);
+        return -1;
+    }
+    if (!strcmp(header, NACK)) {
+        say("ds refused");
+        fclose(f);
+        return 1;
+    }
+    if (sscanf(header, "%d %d", &block, &blocks) != 2) {
+        fclose(f);
+        return -1;
+    }
+
+    stream s;
+    uint32_t *weak = malloc((blocks + 1) * sizeof(uint32_t));
+    uint64_t *strong = malloc((blocks + 1) * sizeof(uint64_t));
+    stream_init(&s, c);
+    for (i = 0; i < blocks; i++) {
+        if (stream_read(&s, &weak[i], sizeof(uint32_t)) < 0 ||
+            stream_read(&s, &strong[i], sizeof(uint64_t)) < 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+
+    char *buf = malloc(block);
+    xxh64_state st;
+    uint64_t length = 0, digest;
+    int n, copied = 0, total = 0, res = 1;
+    xxh64_reset(&st, 0);
+    stream_init(&s, c);
+    for (i = 0; res > 0 && (n = fread(buf, 1, block, f)) > 0; i++) {
+        char op;
+        uint32_t count = 1, index = i, bytes = n;
+
+        xxh64_update(&st, buf, n);
+        length += n;
+        total++;
+        if (i < blocks && rolling_checksum(buf, n) == weak[i] && xxh64(buf, n, 0) == strong[i]) {
+            op = DELTA_COPY;
+            copied++;
+            res = stream_write(&s, &op, 1);
+            if (res > 0) res = stream_write(&s, &index, sizeof(index));
+            if (res > 0) res = stream_write(&s, &count, sizeof(count));
+        } else {
+            op = DELTA_LITERAL;
+            res = stream_write(&s, &op, 1);
+            if (res > 0) res = stream_write(&s, &bytes, sizeof(bytes));
+            if (res > 0) res = stream_write(&s, buf, n);
+        }
+    }
+    char op = DELTA_END;
+    digest = xxh64_digest(&st);
+    if (res > 0) res = stream_write(&s, &op, 1);
+    if (res > 0) res = stream_write(&s, &length, sizeof(length));
+    if (res > 0) res = stream_write(&s, &digest, sizeof(digest));
+    if (res > 0) res = stream_flush(&s);
+
+    free(buf);
+    free(weak);
+    free(strong);
+    fclose(f);
+    if (res < 0) return -1;
+
+    char answer[32];
+    if (recv_raw(answer, sizeof(answer)) < 0) return -1;
+    say("ds copied %d of %d blocks, %s", copied, total, answer);
+
+    return 1;
+}
+
+/* dg <name>: fetch the chunks new_<name> does not have yet and put the
+   file together from both */
+int do_dedup(char *line)
+{
+    char name[256], header[64], basis_name[300];
+    long long size;
+    int count, i, j;
+
+    sscanf(line, "%*s %255s", name);
+    snprintf(basis_name, sizeof(basis_name), "new_%s", name);
+    const cdc_index *basis = cdc_lookup(basis_name);
+
+    if (send_line(line) < 0 || recv_string(header, sizeof(header)) < 0) return -1;
+    if (!strcmp(header, NACK)) {
+        say("dg %s refused", name);
+        return 1;
+    }
+    if (sscanf(header, "%lld %d", &size, &count) != 2) return -1;
+
+    stream s;
+    uint64_t *hash = malloc((count + 1) * sizeof(uint64_t));
+    uint32_t *length = malloc((count + 1) * sizeof(uint32_t));
+    long long *local = malloc((count + 1) * sizeof(long long));
+    uint32_t *list = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t wanted = 0;
+    stream_init(&s, c);
+    for (i = 0; i < count; i++) {
+        if (stream_read(&s, &hash[i], sizeof(uint64_t)) < 0 ||
+            stream_read(&s, &length[i], sizeof(uint32_t)) < 0)
+            return -1;
+
+        /* Where we have it, if we do */
+        local[i] = -1;
+        for (j = 0; basis != NULL && j < basis->count && local[i] < 0; j++)
+            if (basis->chunks[j].hash == hash[i] && basis->chunks[j].length == length[i])
+                local[i] = basis->chunks[j].offset;
+        if (local[i] < 0) list[wanted++] = i;
+    }
+
+    int res;
+    stream_init(&s, c);
+    res = stream_write(&s, &wanted, sizeof(wanted));
+    for (i = 0; i < wanted && res > 0; i++) res = stream_write(&s, &list[i], sizeof(uint32_t));
+    if (res > 0) res = stream_flush(&s);
+
+    /* Both into a new file, then in place of the basis */
+    char part[310];
+    snprintf(part, sizeof(part), "%s.part", basis_name);
+    FILE *in = fopen(basis_name, "r"), *out = fopen(part, "w");
+    char *buf = malloc(CDC_MAX_CHUNK);
+    int good = 1, k = 0;
+    stream_init(&s, c);
+    for (i = 0; i < count && res > 0 && out != NULL; i++) {
+        if (local[i] >= 0) {
+            fseek(in, local[i], SEEK_SET);
+            if (fread(buf, 1, length[i], in) != length[i]) good = 0;
+        } else {
+            res = stream_read(&s, buf, length[i]);
+            k++;
+        }
+        good &= xxh64(buf, length[i], 0) == hash[i];
+        fwrite(buf, 1, length[i], out);
+    }
+    if (in) fclose(in);
+    if (out) fclose(out);
+    rename(part, basis_name);
+
+    free(buf);
+    free(hash);
+    free(length);
+    free(local);
+    free(list);
+    if (res < 0) return -1;
+
+    say("dg fetched %u of %d chunks, %s", wanted, count, good ? "all match" : "mismatch");
+
+    return 1;
+}
+
+/* tg <dir>, mg <pattern>: a stream of files into new_<dir>, new_mg */
+int do_tree_get(char *command, char *line)
+{
+    char root[300], arg[256];
+    stream s;
+
+    sscanf(line, "%*s %255s", arg);
+    snprintf(root, sizeof(root), "new_%s", strcmp(command, "mg") ? arg : "mg");
+    if (send_line(line) < 0) return -1;
+
+    stream_init(&s, c);
+    int files = tree_receive(&s, root);
+    if (files < 0) return -1;
+    say("%s received %d files", command, files);
+
+    return 1;
+}
+
+/* tp <dir> */
+int do_tree_put(char *line)
+{
+    char dir[256];
+    stream s;
+
+    sscanf(line, "%*s %255s", dir);
+    if (send_line(line) < 0) return -1;
+
+    stream_init(&s, c);
+    int files = tree_send(&s, dir);
+    if (files < 0) return -1;
+    say("tp sent %d files", files);
+
+    return 1;
+}
+
+/* hs <name>: whether the server's file is the one fetched as new_<name> */
+int do_hash(char *line)
+{
+    char name[256], answer[64], path[300];
+    long long size, mtime;
+    unsigned long long hash;
+
+    sscanf(line, "%*s %255s", name);
+    if (send_line(line) < 0 || recv_string(answer, sizeof(answer)) < 0) return -1;
+
+    if (sscanf(answer, "%lld %lld %llx", &size, &mtime, &hash) != 3) {
+        say("hs %s %s", name, answer);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "new_%s", name);
+    const file_digest *d = digest_lookup(path);
+    say("hs %s %lld bytes, %s %s", name, size,
+        d != NULL && d->size == size && d->hash == hash ? "same as" : "not", path);
+
+    return 1;
+}
+
+/* fl <name> [offset]: follow for FOLLOW_FOR seconds, then BYE */
+int do_follow(char *line)
+{
+    char name[256], head[64];
+    long long offset, length, start = 0;
+
+    if (sscanf(line, "%*s %255s %lld", name, &start) < 1) return -1;
+    if (send_line(line) < 0) return -1;
+
+    int fd = open_new(name, start == 0);
+    if (fd < 0) return -1;
+
+    time_t until = time(NULL) + FOLLOW_FOR;
+    long long end = start;
+    int res = 1;
+    while (res > 0) {
+        if (recv_string_answered(head, sizeof(head), 0) < 0 ||
+            sscanf(head, "%lld %lld", &offset, &length) != 2) {
+            res = -1;
+            break;
+        }
+
+        if (length == 0 && time(NULL) >= until) {
+            send_raw(BYE);
+            break;
+        }
+        res = send_raw(ACK);
+        if (res >= 0 && length > 0) {
+            res = recv_range(fd, offset, length);
+            end = offset + length;
+        }
+    }
+    close(fd);
+    if (res < 0) return -1;
+
+    say("fl followed %s up to %lld", name, end);
+
+    return 1;
+}
+
+int run(char *line)
+{
+    char command[16] = "";
+
+    sscanf(line, "%15s", command);
+    say("sent %s", line);
+
+    if (!strcmp(command, "cp") || !strcmp(command, "cr")) return do_copy(command, line);
+    if (!strcmp(command, "pr")) return do_parallel(line);
+    if (!strcmp(command, "sn")) return do_send(line);
+    if (!strcmp(command, "ds")) return do_delta(line);
+    if (!strcmp(command, "dg")) return do_dedup(line);
+    if (!strcmp(command, "sz")) return do_size(line);
+    if (!strcmp(command, "tg") || !strcmp(command, "mg")) return do_tree_get(command, line);
+    if (!strcmp(command, "tp")) return do_tree_put(line);
+    if (!strcmp(command, "hs")) return do_hash(line);
+    if (!strcmp(command, "fl")) return do_follow(line);
+
+    /* The rest is the command and its ACK */
+    if (send_line(line) < 0) return -1;
+    if (!strcmp(command, "cz")) compression = atoi(line + 2) != 0;
+    if (!strcmp(command, "at")) set_trim(atoi(line + 2) != 0);
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    char line[1024];
+
+    me = argv[0];
+    output = fopen("client_output", "w");
+    FILE *commands = fopen("commands", "r");
+    if (output == NULL || commands == NULL) {
+        perror("Cannot open the commands or the output");
+        return 1;
+    }
+
+    if (argc > 1) {
+        c = find_codec(argv[1]);
+        if (c == NULL) {
+            printf("[%s] Unknown mode %s\n", me, argv[1]);
+            return 1;
+        }
+    }
+
+    say("Starting.");
+    init(HOST, PORT);
+
+    while (fgets(line, sizeof(line), commands) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0') continue;
+
+        if (run(line) < 0) {
+            say("ERROR Exiting.");
+            break;
+        }
+        if (!strncmp(line, "exit", 4)) break;
+    }
+
+    fclose(commands);
+    fclose(output);
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# run_experiment.sh [mode] [link parameters]: the link, the server and
+# the test client on commands, from this directory
+MODE=$1
+shift
+
+killall link 2> /dev/null
+killall server 2> /dev/null
+killall client 2> /dev/null
+
+../link_emulator/link speed=100 delay=1 "$@" &> /dev/null &
+sleep 1
+../server $MODE &> server_output &
+sleep 1
+
+timeout 60 ./client $MODE
+
+killall link 2> /dev/null
+killall server 2> /dev/null
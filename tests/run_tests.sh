@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# Every test_*.sh, in every running mode given (normal by default)
+FAILED=0
+for MODE in ${@:-""}; do
+    for TEST in test_*.sh; do
+        RESULT=$(./$TEST $MODE)
+        echo "$TEST ${MODE:-normal} $RESULT"
+        [ "$RESULT" = "PASS" ] || FAILED=$((FAILED + 1))
+    done
+done
+
+exit $FAILED
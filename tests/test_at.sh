@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# at: autotuned chunks and trimmed datagrams, both ways
+rm -rf work new_* client_output b.bin
+mkdir work
+seq 1 50000 > work/a.txt
+seq 1 3 300000 > b.bin
+echo "cd work
+at 1
+cp a.txt
+sn b.bin
+at 0
+cp a.txt
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent at 1
+[./client] sent cp a.txt
+[./client] receiving cp 288894
+[./client] sent sn b.bin
+[./client] sending sn 662965
+[./client] sn ACK
+[./client] sent at 0
+[./client] sent cp a.txt
+[./client] receiving cp 288894
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_a.txt work/a.txt || ! cmp -s work/new_b.bin b.bin
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# cp and sn through the codec of the mode, with a long file each way
+rm -rf work new_* client_output b.bin
+mkdir work
+seq 1 50000 > work/a.txt
+seq 1 3 300000 > b.bin
+echo "cd work
+cp a.txt
+sn b.bin
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent cp a.txt
+[./client] receiving cp 288894
+[./client] sent sn b.bin
+[./client] sending sn 662965
+[./client] sn ACK
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_a.txt work/a.txt || ! cmp -s work/new_b.bin b.bin
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# cr: a part of a file, and the rest of it from an offset on
+rm -rf work new_* client_output
+mkdir work
+seq 1 50000 > work/a.txt
+cp work/a.txt work/b.txt
+echo "cd work
+cr a.txt 1000 5000
+cr b.txt 200000 -1
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent cr a.txt 1000 5000
+[./client] receiving cr 5000
+[./client] sent cr b.txt 200000 -1
+[./client] receiving cr 88894
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_a.txt <(tail -c +1001 work/a.txt | head -c 5000) ||
+   ! cmp -s new_b.txt <(tail -c +200001 work/b.txt)
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# cz: compressed chunks both ways, for data that packs and data that does not
+rm -rf work new_* client_output b.txt
+mkdir work
+seq 1 50000 > work/a.txt
+head -c 300000 /dev/urandom > work/r.bin
+seq 7 7 700000 > b.txt
+echo "cd work
+cz 1
+cp a.txt
+cp r.bin
+sn b.txt
+cz 0
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent cz 1
+[./client] sent cp a.txt
+[./client] receiving cp 288894
+[./client] sent cp r.bin
+[./client] receiving cp 300000
+[./client] sent sn b.txt
+[./client] sending sn 684130
+[./client] sn ACK
+[./client] sent cz 0
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_a.txt work/a.txt || ! cmp -s new_r.bin work/r.bin ||
+   ! cmp -s work/new_b.txt b.txt
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# dg: only the chunks the client does not have come over, and a file
+# that is not there is refused
+rm -rf work new_* client_output
+mkdir work
+seq 1 200000 > work/g.txt
+seq 1 200000 | sed 's/^100000$/one hundred thousand/' > new_g.txt
+echo "cd work
+dg g.txt
+dg missing
+dg g.txt
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent dg g.txt
+[./client] dg fetched 1 of 125 chunks, all match
+[./client] sent dg missing
+[./client] dg missing refused
+[./client] sent dg g.txt
+[./client] dg fetched 0 of 125 chunks, all match
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_g.txt work/g.txt
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
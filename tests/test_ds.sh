@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# ds: an upload as a delta against the copy the server has, one block
+# changed, and a name too long for the copy it would make
+LONG=$(printf 'l%.0s' $(seq 1 253))
+rm -rf work new_* client_output d.txt $LONG
+mkdir work
+seq 1 100000 > work/d.txt
+seq 1 100000 | sed 's/^50000$/fifty/' > d.txt
+echo x > $LONG
+echo "cd work
+ds d.txt
+ds d.txt
+ds $LONG
+ds d.txt
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent ds d.txt
+[./client] ds copied 575 of 576 blocks, ACK
+[./client] sent ds d.txt
+[./client] ds copied 576 of 576 blocks, ACK
+[./client] sent ds $LONG
+[./client] ds refused
+[./client] sent ds d.txt
+[./client] ds copied 576 of 576 blocks, ACK
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s work/new_d.txt d.txt
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
+rm -f $LONG
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# fl: follow a file while it grows, then after it was removed and
+# written again
+rm -rf work new_* client_output
+mkdir work
+seq 1 1000 > work/log
+echo "cd work
+fl log
+exit exit
+" > commands
+
+# Grow it once the client has the start, then replace it
+(while [ ! -s new_log ]; do sleep 0.1; done; sleep 0.5; seq 1001 2000 >> work/log
+ sleep 0.5; rm work/log; seq 1 10 > work/log) &
+./run_experiment.sh "$1"
+wait
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent fl log
+[./client] fl followed log up to 21
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s -n 21 new_log work/log
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# hs: the digest of a file matches the copy fetched, and says when there is none
+rm -rf work new_* client_output
+mkdir work
+seq 1 500000 > work/a.txt
+echo "cd work
+cp a.txt
+hs a.txt
+hs missing
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent cp a.txt
+[./client] receiving cp 3388895
+[./client] sent hs a.txt
+[./client] hs a.txt 3388895 bytes, same as new_a.txt
+[./client] sent hs missing
+[./client] hs missing -1
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_a.txt work/a.txt
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
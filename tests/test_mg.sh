@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# mg: the files matching a pattern, and none
+rm -rf work new_* client_output
+mkdir work
+seq 1 1000 > work/m1.log
+seq 1 50000 > work/m2.log
+echo other > work/x.txt
+echo "cd work
+mg *.log
+mg *.none
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent mg *.log
+[./client] mg received 2 files
+[./client] sent mg *.none
+[./client] mg received 0 files
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_mg/m1.log work/m1.log || ! cmp -s new_mg/m2.log work/m2.log ||
+   [ -e new_mg/x.txt ]
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
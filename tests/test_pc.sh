@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# pc: transfers with the pacer on and off again, through a slow link
+rm -rf work new_* client_output
+mkdir work
+seq 1 50000 > work/a.txt
+seq 1 20000 > work/b.txt
+echo "cd work
+pc 1
+cp a.txt
+pc 0
+cp b.txt
+exit exit
+" > commands
+
+./run_experiment.sh "$1" speed=10 queue=20000
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent pc 1
+[./client] sent cp a.txt
+[./client] receiving cp 288894
+[./client] sent pc 0
+[./client] sent cp b.txt
+[./client] receiving cp 108894
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_a.txt work/a.txt || ! cmp -s new_b.txt work/b.txt
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
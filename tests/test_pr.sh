@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# pr: three ranges of a file at once, each on a flow of its own
+rm -rf work new_* client_output
+mkdir work
+seq 1 100000 > work/a.txt
+echo "cd work
+pr a.txt 0 200000 200000 200000 400000 -1
+exit exit
+" > commands
+
+./run_experiment.sh "$1" pairs=4
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent pr a.txt 0 200000 200000 200000 400000 -1
+[./client] receiving pr on 3 flows
+[./client] pr ACK
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_a.txt work/a.txt
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# sz: the datagram size is what the link lets through, up to the one asked
+rm -rf work new_* client_output
+mkdir work
+seq 1 50000 > work/a.txt
+echo "cd work
+sz 8000
+cp a.txt
+exit exit
+" > commands
+
+./run_experiment.sh "$1" mtu=3000
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent sz 8000
+[./client] sz 2946
+[./client] sent cp a.txt
+[./client] receiving cp 288894
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! cmp -s new_a.txt work/a.txt
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
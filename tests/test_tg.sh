@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# tg: a whole tree in one stream. A link left where a file goes is not
+# written through.
+rm -rf work new_* client_output
+mkdir -p work/tree/sub/deep work/tree/empty new_tree
+for i in $(seq 1 200); do echo "file $i" > work/tree/f$i; done
+seq 1 50000 > work/tree/sub/big
+echo x > work/tree/sub/deep/y
+echo victim > work/victim
+ln -s ../work/victim new_tree/f1
+echo "cd work
+tg tree
+exit exit
+" > commands
+
+# The client says it skipped the link
+./run_experiment.sh "$1" > /dev/null
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent tg tree
+[./client] tg received 201 files
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! diff -r -q -x f1 new_tree work/tree > /dev/null ||
+   [ "$(cat work/victim)" != victim ]
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
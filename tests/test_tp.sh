@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# tp: a whole tree the other way, with a directory the owner cannot
+# write to that still has to be filled
+chmod -R u+w work up 2> /dev/null
+rm -rf work new_* client_output up
+mkdir -p work up/sub/deep up/empty up/sealed
+for i in $(seq 1 200); do echo "file $i" > up/f$i; done
+seq 1 50000 > up/sub/big
+echo x > up/sub/deep/y
+echo y > up/sealed/z
+chmod 555 up/sealed
+echo "cd work
+tp up
+exit exit
+" > commands
+
+./run_experiment.sh "$1"
+
+echo "[./client] Starting.
+[./client] sent cd work
+[./client] sent tp up
+[./client] tp sent 203 files
+[./client] sent exit exit" > expected
+
+DIFF=$(diff client_output expected)
+if [ "$DIFF" != "" ] || ! diff -r -q work/new_up up > /dev/null ||
+   [ "$(stat -c %a work/new_up/sealed)" != 555 ]
+then
+    echo "FAIL"
+else
+    echo "PASS"
+fi
+chmod -R u+w work up
+rm -rf up
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../lz.h"
+#include "../hash.h"
+#include "../cdc.h"
+
+/* Round trip checks of the building blocks the commands stand on. Every
+   check prints PASS or FAIL; the exit status is the number that failed. */
+
+#define BIG (1 << 20)
+
+static int failed = 0;
+
+static void check(const char *name, int ok)
+{
+    printf("[units] %s %s\n", name, ok ? "PASS" : "FAIL");
+    if (!ok) failed++;
+}
+
+/* Reproducible data: random, text like, or long runs */
+static unsigned long long state;
+
+static unsigned next_random()
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state >> 33;
+}
+
+static void fill_random(char *buf, int n, unsigned long long seed)
+{
+    int i;
+
+    state = seed;
+    for (i = 0; i < n; i++) buf[i] = next_random();
+}
+
+static void fill_text(char *buf, int n, unsigned long long seed)
+{
+    static const char *words[] = { "file ", "server ", "link ", "chunk ", "ack ",
+                                   "package ", "\n", "the ", "of ", "0123 " };
+    int i = 0;
+
+    state = seed;
+    while (i < n) {
+        const char *w = words[next_random() % 10];
+        while (*w && i < n) buf[i++] = *w++;
+    }
+}
+
+/* Compress and decompress n bytes, 1 if they come back the same */
+static int lz_round_trip(const char *in, int n)
+{
+    int cap = n + n / 8 + 64;
+    char *packed = malloc(cap), *out = malloc(n + 1);
+    int ok = 0;
+
+    int len = lz_compress(in, n, packed, cap);
+    if (len >= 0) ok = lz_decompress(packed, len, out, n) == n && !memcmp(in, out, n);
+
+    free(packed);
+    free(out);
+
+    return ok;
+}
+
+static void test_lz(char *buf)
+{
+    int sizes[] = { 0, 1, 4, 13, 64, 1000, 4096, 65536, 65537, BIG };
+    int i, ok;
+
+    for (i = 0, ok = 1; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        fill_random(buf, sizes[i], i);
+        ok &= lz_round_trip(buf, sizes[i]);
+    }
+    check("lz round trip, random data", ok);
+
+    for (i = 0, ok = 1; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        fill_text(buf, sizes[i], i);
+        ok &= lz_round_trip(buf, sizes[i]);
+    }
+    check("lz round trip, text", ok);
+
+    /* Runs make matches that overlap what they copy */
+    memset(buf, 'x', BIG);
+    for (i = 0; i < BIG; i += 100000) buf[i] = 'y';
+    check("lz round trip, long runs", lz_round_trip(buf, BIG));
+
+    /* Text has to get smaller, a run a lot smaller */
+    char *packed = malloc(BIG);
+    fill_text(buf, 65536, 7);
+    int len = lz_compress(buf, 65536, packed, BIG);
+    check("lz compresses text", len > 0 && len < 65536 / 2);
+    memset(buf, 0, 65536);
+    len = lz_compress(buf, 65536, packed, BIG);
+    check("lz compresses a run", len > 0 && len < 65536 / 100);
+
+    /* No room is an error, not an overflow */
+    fill_random(buf, 4096, 1);
+    check("lz refuses a small output", lz_compress(buf, 4096, packed, 1000) == -1);
+
+    /* Damaged or cut blocks are refused, and never written past cap */
+    fill_text(buf, 4096, 2);
+    len = lz_compress(buf, 4096, packed, BIG);
+    char *out = malloc(4096 + 64);
+    memset(out + 4096, 0x5a, 64);
+    int cut_ok = lz_decompress(packed, len / 2, out, 4096) != 4096;
+    int small_ok = lz_decompress(packed, len, out, 100) == -1;
+    for (i = 0; i < 64; i++) small_ok &= out[4096 + i] == 0x5a;
+    check("lz refuses a cut block", cut_ok);
+    check("lz refuses a small room", small_ok);
+    free(out);
+    free(packed);
+}
+
+static void test_xxh64(char *buf)
+{
+    /* Reference values of the XXH64 specification */
+    check("xxh64 of nothing", xxh64("", 0, 0) == 0xef46db3751d8e999ULL);
+    check("xxh64 of abc", xxh64("abc", 3, 0) == 0x44bc2cf5ad770999ULL);
+
+    /* Fed in pieces of any size, the digest is the same */
+    int sizes[] = { 0, 1, 3, 31, 32, 33, 63, 64, 100, 1000, 100000 };
+    int i, step, ok = 1;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        fill_random(buf, sizes[i], 100 + i);
+        uint64_t whole = xxh64(buf, sizes[i], 42);
+        for (step = 1; step < 80; step += 7) {
+            xxh64_state st;
+            int pos, n;
+            xxh64_reset(&st, 42);
+            for (pos = 0; pos < sizes[i]; pos += n) {
+                n = sizes[i] - pos < step ? sizes[i] - pos : step;
+                xxh64_update(&st, buf + pos, n);
+            }
+            ok &= xxh64_digest(&st) == whole;
+        }
+    }
+    check("xxh64 in pieces", ok);
+
+    /* The seed and every byte count */
+    fill_random(buf, 1000, 3);
+    uint64_t h = xxh64(buf, 1000, 0);
+    int differ = xxh64(buf, 1000, 1) != h;
+    for (i = 0; i < 1000; i += 37) {
+        buf[i] ^= 1;
+        differ &= xxh64(buf, 1000, 0) != h;
+        buf[i] ^= 1;
+    }
+    check("xxh64 sees the seed and every byte", differ);
+}
+
+static void test_rolling(char *buf)
+{
+    int windows[] = { 1, 16, 512, 4096 };
+    int i, w, ok = 1;
+
+    fill_random(buf, 20000, 5);
+    for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        int len = windows[w];
+        uint32_t sum = rolling_checksum(buf, len);
+        for (i = 0; i + len < 20000; i++) {
+            sum = rolling_roll(sum, buf[i], buf[i + len], len);
+            if (sum != rolling_checksum(buf + i + 1, len)) {
+                ok = 0;
+                break;
+            }
+        }
+    }
+    check("rolling checksum rolls as it sums", ok);
+}
+
+/* Write n bytes to a file of its own, for cdc_lookup */
+static int put_file(const char *path, const char *buf, int n)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+    int ok = fwrite(buf, 1, n, f) == n;
+    fclose(f);
+
+    return ok ? 0 : -1;
+}
+
+static void test_cdc(char *buf)
+{
+    char path[] = "/tmp/units_cdcXXXXXX";
+    int fd = mkstemp(path);
+    int i, n = BIG - 1000;
+    if (fd < 0) {
+        check("cdc index", 0);
+        return;
+    }
+    close(fd);
+
+    /* Chunks tile the file, within the bounds, named by their bytes */
+    fill_random(buf, BIG, 9);
+    put_file(path, buf, n);
+    const cdc_index *idx = cdc_lookup(path);
+    int ok = idx != NULL && idx->size == n && idx->count > 1;
+    long long offset = 0;
+    for (i = 0; ok && i < idx->count; i++) {
+        const cdc_chunk *c = &idx->chunks[i];
+        ok &= c->offset == offset && c->length <= CDC_MAX_CHUNK;
+        ok &= c->length >= CDC_MIN_CHUNK || i == idx->count - 1;
+        ok &= c->hash == xxh64(buf + c->offset, c->length, 0);
+        offset += c->length;
+    }
+    check("cdc chunks tile the file", ok && offset == n);
+
+    /* About one cut every 2^CDC_AVG_BITS bytes past the minimum */
+    int expected = n / (CDC_MIN_CHUNK + (1 << CDC_AVG_BITS));
+    check("cdc average chunk size", ok && idx->count > expected / 2 && idx->count < expected * 2);
+
+    /* A few bytes inserted near the start move the cuts after them
+       along, so most chunks are still found */
+    uint64_t *before = malloc(idx->count * sizeof(uint64_t));
+    int count = idx->count;
+    for (i = 0; i < count; i++) before[i] = idx->chunks[i].hash;
+    memmove(buf + 5000 + 7, buf + 5000, n - 5000);
+    memcpy(buf + 5000, "INSERTS", 7);
+    put_file(path, buf, n + 7);
+    /* Same second, the size tells it changed */
+    idx = cdc_lookup(path);
+    int found = 0, j;
+    for (i = 0; idx != NULL && i < idx->count; i++)
+        for (j = 0; j < count; j++)
+            if (idx->chunks[i].hash == before[j]) {
+                found++;
+                break;
+            }
+    check("cdc cuts follow the content", idx != NULL && found >= count - 3);
+    free(before);
+
+    /* Data without any cut point is cut at the maximum */
+    memset(buf, 0, 3 * CDC_MAX_CHUNK);
+    put_file(path, buf, 3 * CDC_MAX_CHUNK);
+    idx = cdc_lookup(path);
+    check("cdc cuts a run at the maximum",
+          idx != NULL && idx->count == 3 && idx->chunks[0].length == CDC_MAX_CHUNK);
+
+    unlink(path);
+}
+
+int main()
+{
+    char *buf = malloc(BIG + 16);
+
+    test_lz(buf);
+    test_xxh64(buf);
+    test_rolling(buf);
+    test_cdc(buf);
+
+    free(buf);
+
+    return failed;
+}
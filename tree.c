@@ -0,0 +1,266 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tree.h"
+
+/* File content goes through the stream in pieces of this size */
+#define TREE_PIECE (64 * 1024)
+
+static int put_header(stream *s, char type, uint32_t mode, int64_t size, const char *path)
+{
+    char header[TREE_HEADER];
+    uint16_t len = strlen(path);
+
+    header[0] = type;
+    memcpy(header + 1, &mode, sizeof(mode));
+    memcpy(header + 5, &size, sizeof(size));
+    memcpy(header + 13, &len, sizeof(len));
+
+    if (stream_write(s, header, TREE_HEADER) < 0) return -1;
+    return stream_write(s, path, len);
+}
+
+static int send_file(stream *s, FILE *f, const char *path, const struct stat *st, char *buf)
+{
+    int64_t size = st->st_size, sent = 0;
+    int res = put_header(s, TREE_FILE, st->st_mode & 07777, size, path);
+    while (res > 0 && sent < size) {
+        int k = size - sent < TREE_PIECE ? size - sent : TREE_PIECE;
+        int n = fread(buf, sizeof(char), k, f);
+        if (n < k) {
+            /* Shrunk under us, the announced size still has to go */
+            memset(buf + (n > 0 ? n : 0), 0, k - (n > 0 ? n : 0));
+        }
+        res = stream_write(s, buf, k);
+        sent += k;
+    }
+
+    return res < 0 ? -1 : 1;
+}
+
+int tree_send_file(stream *s, FILE *f, const char *path)
+{
+    struct stat st;
+
+    if (fstat(fileno(f), &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+
+    char *buf = malloc(TREE_PIECE);
+    if (buf == NULL) return -1;
+    int res = send_file(s, f, path, &st, buf);
+    free(buf);
+
+    return res;
+}
+
+int tree_send_end(stream *s)
+{
+    if (put_header(s, TREE_END, 0, 0, "") < 0) return -1;
+    return stream_flush(s);
+}
+
+/* Send the entries of the directory full, known as path in the tree */
+static int send_dir(stream *s, const char *full, const char *path, char *buf)
+{
+    DIR *dir = opendir(full);
+    struct dirent *entry;
+    int files = 0, res;
+
+    if (dir == NULL) {
+        printf("[SERVER] Skipping %s, cannot open it\n", full);
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        char child_full[PATH_MAX], child[PATH_MAX];
+        struct stat st;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        snprintf(child_full, sizeof(child_full), "%s/%s", full, entry->d_name);
+        snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "", entry->d_name);
+        if (lstat(child_full, &st) < 0) continue;
+
+        /* Links, devices and the like are left out */
+        if (S_ISDIR(st.st_mode)) {
+            res = put_header(s, TREE_DIR, st.st_mode & 07777, 0, child);
+            if (res > 0) res = send_dir(s, child_full, child, buf);
+        } else if (S_ISREG(st.st_mode)) {
+            FILE *f = fopen(child_full, "r");
+            if (f == NULL) {
+                printf("[SERVER] Skipping %s, cannot open it\n", child_full);
+                continue;
+            }
+            res = send_file(s, f, child, &st, buf);
+            fclose(f);
+        } else {
+            continue;
+        }
+
+        if (res < 0) {
+            closedir(dir);
+            return -1;
+        }
+        files += res;
+    }
+    closedir(dir);
+
+    return files;
+}
+
+int tree_send(stream *s, const char *root)
+{
+    char *buf = malloc(TREE_PIECE);
+    if (buf == NULL) return -1;
+    int files = send_dir(s, root, "", buf);
+    free(buf);
+
+    if (files < 0 || tree_send_end(s) < 0) return -1;
+
+    return files;
+}
+
+/* Only paths that stay inside the root are taken */
+static int safe_path(const char *path)
+{
+    const char *p = path;
+
+    if (*path == '\0' || *path == '/') return 0;
+    while (p) {
+        if (!strncmp(p, "..", 2) && (p[2] == '/' || p[2] == '\0')) return 0;
+        p = strchr(p, '/');
+        if (p) p++;
+    }
+
+    return 1;
+}
+
+/* The directories tree_receive made, in the order they came */
+typedef struct {
+    char **paths;
+    uint32_t *modes;
+    int count, size;
+} made_dirs;
+
+static void remember_dir(made_dirs *d, const char *full, uint32_t mode)
+{
+    if (d->count == d->size) {
+        int size = d->size ? 2 * d->size : 64;
+        char **paths = realloc(d->paths, size * sizeof(char *));
+        if (paths == NULL) return;
+        d->paths = paths;
+        uint32_t *modes = realloc(d->modes, size * sizeof(uint32_t));
+        if (modes == NULL) return;
+        d->modes = modes;
+        d->size = size;
+    }
+
+    d->paths[d->count] = strdup(full);
+    if (d->paths[d->count] == NULL) return;
+    d->modes[d->count++] = mode;
+}
+
+/* Give the directories the modes that were sent, children before their
+   parents since they came parents first, so that a parent made read-only
+   is not in the way. Then forget them. */
+static void settle_dirs(made_dirs *d, int apply)
+{
+    while (d->count--) {
+        if (apply && chmod(d->paths[d->count], d->modes[d->count]) < 0)
+            printf("[SERVER] Cannot set the mode of %s\n", d->paths[d->count]);
+        free(d->paths[d->count]);
+    }
+    free(d->paths);
+    free(d->modes);
+}
+
+int tree_receive(stream *s, const char *root)
+{
+    char header[TREE_HEADER], path[PATH_MAX], full[2 * PATH_MAX];
+    made_dirs dirs = { NULL, NULL, 0, 0 };
+    int files = 0;
+
+    char *buf = malloc(TREE_PIECE);
+    if (buf == NULL) return -1;
+
+    if (mkdir(root, 0777) < 0 && errno != EEXIST)
+        printf("[SERVER] Cannot create %s\n", root);
+
+    for (;;) {
+        uint32_t mode;
+        int64_t size;
+        uint16_t len;
+
+        if (stream_read(s, header, TREE_HEADER) < 0) break;
+        memcpy(&mode, header + 1, sizeof(mode));
+        memcpy(&size, header + 5, sizeof(size));
+        memcpy(&len, header + 13, sizeof(len));
+        if (len >= PATH_MAX || size < 0 || stream_read(s, path, len) < 0) break;
+        path[len] = '\0';
+
+        if (header[0] == TREE_END) {
+            settle_dirs(&dirs, 1);
+            free(buf);
+            return files;
+        }
+
+        int usable = safe_path(path);
+        if (!usable) printf("[SERVER] Refusing path %s\n", path);
+        snprintf(full, sizeof(full), "%s/%s", root, path);
+
+        if (header[0] == TREE_DIR) {
+            /* Keep the directory writable while we fill it, it gets its
+               own mode at the end */
+            if (!usable) continue;
+            if (mkdir(full, (mode & 07777) | 0700) < 0 && errno != EEXIST)
+                printf("[SERVER] Cannot create %s\n", full);
+            else
+                remember_dir(&dirs, full, mode & 07777);
+            continue;
+        }
+        if (header[0] != TREE_FILE) break;
+
+        /* Never write through a link that was there before */
+        FILE *f = NULL;
+        if (usable) {
+            int fd = open(full, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+            if (fd >= 0 && (f = fdopen(fd, "w")) == NULL) close(fd);
+            if (f == NULL) printf("[SERVER] Cannot create %s\n", full);
+        }
+
+        int64_t got = 0;
+        while (got < size) {
+            int k = size - got < TREE_PIECE ? size - got : TREE_PIECE;
+            if (stream_read(s, buf, k) < 0) {
+                if (f) fclose(f);
+                settle_dirs(&dirs, 0);
+                free(buf);
+                return -1;
+            }
+            if (f && fwrite(buf, sizeof(char), k, f) != k) {
+                printf("[SERVER] Failed to write %s\n", full);
+                fclose(f);
+                f = NULL;
+            }
+            got += k;
+        }
+        if (f) {
+            fchmod(fileno(f), mode & 07777);
+            if (fclose(f) == 0)
+                files++;
+            else
+                printf("[SERVER] Failed to write %s\n", full);
+        }
+    }
+
+    settle_dirs(&dirs, 0);
+    free(buf);
+
+    return -1;
+}
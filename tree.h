@@ -0,0 +1,40 @@
+#ifndef TREE
+#define TREE
+
+#include <stdio.h>
+
+#include "stream.h"
+
+/* A directory tree as one stream of records, files back to back, so
+   that many small files share packages instead of each paying for its
+   own command, length and ACKs.
+
+   Every record starts with a header: the type (one byte), the mode
+   (uint32), the size (int64), the length of the path (uint16) and the
+   path relative to the root of the tree. A file record is followed by
+   size bytes of content. The tree ends with an end record. */
+
+#define TREE_DIR 'D'
+#define TREE_FILE 'F'
+#define TREE_END 'E'
+
+#define TREE_HEADER (1 + 4 + 8 + 2)
+
+/* Send every directory and regular file under root, parents first.
+   Returns the number of files sent, or -1 if the transfer broke. */
+int tree_send(stream *s, const char *root);
+
+/* The same records for files picked some other way: one file record
+   for f, known as path (0 and nothing sent if f is not a regular file),
+   then the end record. Return -1 if the transfer broke. */
+int tree_send_file(stream *s, FILE *f, const char *path);
+int tree_send_end(stream *s);
+
+/* Recreate a tree sent by tree_send under root. Entries that cannot be
+   created are skipped, the stream is still drained; files are never
+   written through a link. Directories get their modes once the tree is
+   complete. Returns the number of files written, or -1 if the transfer
+   broke or was malformed. */
+int tree_receive(stream *s, const char *root);
+
+#endif
@@ -0,0 +1,138 @@
+#include <math.h>
+#include <pthread.h>
+
+#include "tune.h"
+
+/* Bits after which old observations weigh half as much */
+#define TUNE_WINDOW (8 * 1024 * 1024)
+/* Weight kept by the old timing samples at every new one */
+#define TUNE_DECAY 0.98
+/* Timing samples needed before the per package cost is trusted */
+#define TUNE_MIN_SAMPLES 8
+/* Smallest data size we go down to */
+#define TUNE_MIN_CHUNK 64
+/* Bytes on the wire around the payload: the len field plus UDP/IP */
+#define WIRE_OVERHEAD (sizeof(int) + 28)
+
+static int enabled = 0;
+
+/* Parallel flows feed and read the same estimates */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bit error counters, halved every TUNE_WINDOW bits */
+static double bits_seen = 0, bits_bad = 0;
+
+/* Decayed sums for the fit seconds = fixed + per_byte * wire bytes */
+static double samples = 0, sum_w = 0, sum_t = 0, sum_ww = 0, sum_wt = 0;
+
+void tune_enable(int on)
+{
+    enabled = on;
+}
+
+int tune_enabled()
+{
+    return enabled;
+}
+
+void tune_errors(int bits, int errors)
+{
+    pthread_mutex_lock(&lock);
+    bits_seen += bits;
+    bits_bad += errors;
+
+    while (bits_seen > TUNE_WINDOW) {
+        bits_seen /= 2;
+        bits_bad /= 2;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void tune_timing(int bytes, double seconds)
+{
+    pthread_mutex_lock(&lock);
+    samples = samples * TUNE_DECAY + 1;
+    sum_w = sum_w * TUNE_DECAY + bytes;
+    sum_t = sum_t * TUNE_DECAY + seconds;
+    sum_ww = sum_ww * TUNE_DECAY + (double)bytes * bytes;
+    sum_wt = sum_wt * TUNE_DECAY + bytes * seconds;
+    pthread_mutex_unlock(&lock);
+}
+
+double tune_ber()
+{
+    double ber = 0;
+
+    pthread_mutex_lock(&lock);
+    if (bits_seen > 0) ber = bits_bad / bits_seen;
+    pthread_mutex_unlock(&lock);
+
+    return ber;
+}
+
+/* Least squares fit of the package cost. Without enough spread in the
+   sizes seen so far, assume the cost is proportional to the size. */
+static void package_cost(double *fixed, double *per_byte)
+{
+    *fixed = 0;
+    *per_byte = 1;
+    if (samples < TUNE_MIN_SAMPLES) return;
+
+    double mean_w = sum_w / samples, mean_t = sum_t / samples;
+    double var_w = sum_ww / samples - mean_w * mean_w;
+    if (var_w < 1) return;
+
+    double b = (sum_wt / samples - mean_w * mean_t) / var_w;
+    double a = mean_t - b * mean_w;
+    if (b <= 0) {
+        /* Size does not show in the time, only the package count does */
+        *fixed = 1;
+        *per_byte = 0;
+    } else {
+        *fixed = a > 0 ? a : 0;
+        *per_byte = b;
+    }
+}
+
+static double goodput(const codec *c, double expansion, int n,
+                      double ber, double fixed, double per_byte)
+{
+    double wire = WIRE_OVERHEAD + c->header + n * expansion;
+    double delivered = c->retransmits ? pow(1 - ber, 8 * wire) : 1;
+    return n * delivered / (fixed + per_byte * wire);
+}
+
+int tune_capacity(const codec *c, int msgsize)
+{
+    int hi = c->capacity(msgsize);
+    int lo = TUNE_MIN_CHUNK < hi ? TUNE_MIN_CHUNK : hi;
+    double ber = tune_ber();
+
+    /* A codec that never resends gains nothing from smaller packages */
+    if (!c->retransmits || ber == 0) return hi;
+
+    double fixed, per_byte;
+    pthread_mutex_lock(&lock);
+    package_cost(&fixed, &per_byte);
+    pthread_mutex_unlock(&lock);
+    double expansion = (double)(msgsize - c->header) / hi;
+
+    /* Goodput is unimodal in the chunk size, a ternary search finds the top */
+    while (hi - lo > 2) {
+        int m1 = lo + (hi - lo) / 3, m2 = hi - (hi - lo) / 3;
+        if (goodput(c, expansion, m1, ber, fixed, per_byte) <
+            goodput(c, expansion, m2, ber, fixed, per_byte))
+            lo = m1 + 1;
+        else
+            hi = m2 - 1;
+    }
+
+    int n, best = lo;
+    for (n = lo + 1; n <= hi; n++) {
+        if (goodput(c, expansion, n, ber, fixed, per_byte) >
+            goodput(c, expansion, best, ber, fixed, per_byte))
+            best = n;
+    }
+
+    return best;
+}
@@ -0,0 +1,27 @@
+#ifndef TUNE
+#define TUNE
+
+#include "codec.h"
+
+/* Chunk size autotuning.
+
+   The codecs report how many bits went through them and how many were
+   found bad, the transfer loops report how long a package took to get
+   confirmed. From the bit error rate and the per package cost we pick
+   the amount of data per package that gives the best goodput. */
+
+void tune_enable(int on);
+int tune_enabled();
+
+/* A codec saw bits bits, errors of them were bad */
+void tune_errors(int bits, int errors);
+
+/* A package of bytes bytes on the wire got its answer after seconds */
+void tune_timing(int bytes, double seconds);
+
+double tune_ber();
+
+/* Data bytes to put in the next package, at most c->capacity(msgsize) */
+int tune_capacity(const codec *c, int msgsize);
+
+#endif
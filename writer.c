@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+static int write_all(int fd, const char *p, int n, long long offset)
+{
+    while (n > 0) {
+        int k = pwrite(fd, p, n, offset);
+        if (k < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += k;
+        n -= k;
+        offset += k;
+    }
+
+    return 1;
+}
+
+static void *write_behind(void *argument)
+{
+    writer *w = argument;
+    long long offset = 0, unsynced = 0;
+    int slot;
+
+    /* Keep draining after a failure so that the receiver never blocks */
+    while ((slot = ring_consume(&w->full)) >= 0) {
+        char *p = w->buffers[slot];
+        int len = w->lens[slot];
+
+        if (!w->failed) {
+            /* Only the last buffer can be partial. O_DIRECT takes its
+               aligned part, the tail goes through the page cache. */
+            int aligned = w->direct ? len & ~(WRITE_ALIGN - 1) : len;
+            if (write_all(w->fd, p, aligned, offset) < 0) w->failed = 1;
+            if (!w->failed && aligned < len) {
+                fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+                w->direct = 0;
+                if (write_all(w->fd, p + aligned, len - aligned, offset + aligned) < 0)
+                    w->failed = 1;
+            }
+            if (w->failed) perror("[SERVER] Failed to write the file\n");
+
+            offset += len;
+            unsynced += len;
+            if (w->policy == DURABLE_PERIODIC && unsynced >= WRITE_SYNC_EVERY) {
+                if (fdatasync(w->fd) < 0) w->failed = 1;
+                unsynced = 0;
+            }
+        }
+
+        ring_consumed(&w->full);
+    }
+
+    return NULL;
+}
+
+int writer_open(writer *w, const char *path, int policy, int direct)
+{
+    int i;
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0666);
+    if (w->fd < 0 && direct && errno == EINVAL) {
+        /* tmpfs and friends have no O_DIRECT */
+        direct = 0;
+        w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (w->fd < 0) return -1;
+
+    for (i = 0; i < WRITE_BUFFERS; i++) {
+        if (posix_memalign((void **)&w->buffers[i], WRITE_ALIGN, WRITE_BUFFER)) {
+            while (i--) free(w->buffers[i]);
+            close(w->fd);
+            return -1;
+        }
+    }
+
+    w->direct = direct;
+    w->policy = policy;
+    w->current = -1;
+    w->failed = 0;
+    ring_init(&w->full, WRITE_BUFFERS);
+    if (pthread_create(&w->thread, NULL, write_behind, w) != 0) {
+        for (i = 0; i < WRITE_BUFFERS; i++) free(w->buffers[i]);
+        close(w->fd);
+        return -1;
+    }
+
+    return 1;
+}
+
+int writer_write(writer *w, const char *data, int n)
+{
+    while (n > 0) {
+        if (w->failed) return -1;
+
+        /* Waits only if the disk is behind by every buffer */
+        if (w->current < 0) {
+            w->current = ring_produce(&w->full);
+            w->lens[w->current] = 0;
+        }
+
+        int len = w->lens[w->current];
+        int k = WRITE_BUFFER - len < n ? WRITE_BUFFER - len : n;
+        memcpy(w->buffers[w->current] + len, data, k);
+        w->lens[w->current] += k;
+        data += k;
+        n -= k;
+
+        if (w->lens[w->current] == WRITE_BUFFER) {
+            ring_produced(&w->full);
+            w->current = -1;
+        }
+    }
+
+    return 1;
+}
+
+int writer_close(writer *w)
+{
+    int i;
+
+    if (w->current >= 0) {
+        if (w->lens[w->current] > 0) ring_produced(&w->full);
+        w->current = -1;
+    }
+    ring_close(&w->full);
+    pthread_join(w->thread, NULL);
+
+    if (!w->failed && w->policy != DURABLE_NONE && fdatasync(w->fd) < 0) {
+        perror("[SERVER] Failed to sync the file\n");
+        w->failed = 1;
+    }
+    if (close(w->fd) < 0) w->failed = 1;
+
+    for (i = 0; i < WRITE_BUFFERS; i++) free(w->buffers[i]);
+
+    return w->failed ? -1 : 1;
+}
+
+int durability_policy(const char *name)
+{
+    if (!strcmp(name, "none")) return DURABLE_NONE;
+    if (!strcmp(name, "end")) return DURABLE_END;
+    if (!strcmp(name, "periodic")) return DURABLE_PERIODIC;
+
+    return -1;
+}
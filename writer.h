@@ -0,0 +1,53 @@
+#ifndef WRITER
+#define WRITER
+
+#include <pthread.h>
+
+#include "ring.h"
+
+/* Write-behind for uploads: received data is gathered into a few large
+   buffers that a background thread writes out, so the receive loop
+   (and the client's ACKs) never wait on the disk unless every buffer
+   is still pending. */
+
+#define WRITE_BUFFER (1024 * 1024)
+#define WRITE_BUFFERS 8
+/* Alignment of buffers, offsets and lengths for O_DIRECT */
+#define WRITE_ALIGN 4096
+/* Bytes between two syncs with the periodic policy */
+#define WRITE_SYNC_EVERY (16 * 1024 * 1024)
+
+/* When the data is forced to storage */
+#define DURABLE_NONE 0
+#define DURABLE_END 1
+#define DURABLE_PERIODIC 2
+
+typedef struct {
+    int fd;
+    int direct;
+    int policy;
+    pthread_t thread;
+    ring full;
+    char *buffers[WRITE_BUFFERS];
+    int lens[WRITE_BUFFERS];
+    /* Buffer being filled, -1 if none */
+    int current;
+    /* Set by the background thread when a write or sync failed */
+    int failed;
+} writer;
+
+/* Create path for writing. direct asks for O_DIRECT, which is dropped
+   where the file system does not support it. Returns 1, or -1. */
+int writer_open(writer *w, const char *path, int policy, int direct);
+
+/* Queue n bytes. Returns -1 if an earlier write already failed. */
+int writer_write(writer *w, const char *data, int n);
+
+/* Write out the rest, apply the durability policy and close the file.
+   Returns 1 if every byte was written, -1 otherwise. */
+int writer_close(writer *w);
+
+/* DURABLE_* for a policy name (none, end, periodic), -1 if unknown */
+int durability_policy(const char *name);
+
+#endif